@@ -62,11 +62,43 @@ bool CDGFile::open(CdgIoStream* pStream, ISurface* pSurface)
 
     reset();
 
-    m_duration = ((m_pStream->getsize() / CDG_PACKET_SIZE) * 1000) / 300;
+    // The size of a pipe is not known, the duration is found at the end of the stream
+    m_duration = getStreamDuration(m_pStream);
 
     return true;
 }
 
+long CDGFile::getStreamDuration(CdgIoStream* pStream)
+{
+    return ((pStream->getsize() / CDG_PACKET_SIZE) * 1000) / 300;
+}
+
+int CDGFile::findSceneResets(long* times, int max)
+{
+    CdgPacket pack;
+    long packet = 0;
+    int count = 0;
+
+    // the stream must be rewound afterwards
+    if (m_pStream == NULL || m_positionMs != 0 || m_pStream->seek(0, SEEK_SET) < 0) return 0;
+
+    while (count < max && readPacket(pack))
+    {
+        // the repeated presets don't clear the screen again
+        if ((pack.command & CDG_MASK) == CDG_COMMAND &&
+            (pack.instruction & CDG_MASK) == CDG_INST_MEMORY_PRESET &&
+            (pack.data[1] & 0x0F) == 0)
+        {
+            // rendered at this time, the screen is the one before the reset
+            times[count++] = packet / 3 * 10;
+        }
+        packet++;
+    }
+
+    m_pStream->seek(0, SEEK_SET);
+    return count;
+}
+
 // Close currently open file
 
 void CDGFile::close()
@@ -91,6 +123,12 @@ void CDGFile::reset()
     m_duration = 0;
     m_positionMs = 0;
 
+    memset(m_tileChanged, 0, sizeof(m_tileChanged));
+    m_changedTiles = 0;
+    m_repaint = true;
+    m_memoryPreset = false;
+    m_sceneCut = false;
+
     // clear surface 
     if (m_pSurface)
     {
@@ -107,6 +145,26 @@ void CDGFile::reset()
 //  false - if the end of the file is reached, the file is not opened or surface is not set
 
 bool CDGFile::renderAtPosition(long ms)
+{
+    if (m_pStream == NULL) 
+    {
+        return false;
+    }
+
+    bool res = advanceTo(ms);
+
+    render();
+    return res;
+}
+
+// Process the packets up to a position without rendering them, to skip
+// to a point of the song in no time
+// Parameters:
+//  int ms - position in miliseconds
+// Return:
+//  false - if the end of the file is reached or the file is not opened
+
+bool CDGFile::advanceTo(long ms)
 {
     CdgPacket pack;
     long numPacks = 0;
@@ -136,7 +194,11 @@ bool CDGFile::renderAtPosition(long ms)
         processPacket(&pack);
     }
 
-    render();
+    if (res == false && m_duration == 0)
+    {
+        m_duration = m_positionMs;
+    }
+
     return res;
 }
 
@@ -244,6 +306,8 @@ void CDGFile::memoryPreset(const CdgPacket *pack)
                 m_pixelColours[ri][ci] = colour;
             }
         }
+
+        m_memoryPreset = true;
     }
 }
 
@@ -499,25 +563,53 @@ void CDGFile::scroll(const CdgPacket *pack, bool copy)
     }
 }
 
+// Paint the surface and note the tiles that changed since the last frame.
+// The comparison is done on the final RGB values, so colour table changes,
+// scrolling and the offsets are all accounted for.
+
 void CDGFile::render()
 {
     if (m_pSurface == NULL) return;
 
+    memset(m_tileChanged, 0, sizeof(m_tileChanged));
+    m_changedTiles = 0;
+
     for (int ri = 0; ri < CDG_FULL_HEIGHT; ++ri) 
     {
         for (int ci = 0; ci < CDG_FULL_WIDTH; ++ci) 
         {
+            unsigned long colour;
+
             if (ri < TILE_HEIGHT || ri >= CDG_FULL_HEIGHT-TILE_HEIGHT ||
                 ci < TILE_WIDTH  || ci >= CDG_FULL_WIDTH-TILE_WIDTH)
             {
-                m_pSurface->rgbData[ri][ci] = m_colourTable[m_borderColourIndex];
+                colour = m_colourTable[m_borderColourIndex];
             }
             else
             {
-                m_pSurface->rgbData[ri][ci] = 
-                    m_colourTable[m_pixelColours[ri+m_vOffset][ci+m_hOffset]];
+                colour = m_colourTable[m_pixelColours[ri+m_vOffset][ci+m_hOffset]];
+            }
+
+            if (m_pSurface->rgbData[ri][ci] != colour || m_repaint)
+            {
+                m_pSurface->rgbData[ri][ci] = colour;
+                m_tileChanged[ri / TILE_HEIGHT][ci / TILE_WIDTH] = true;
             }
         }
     }
+
+    for (int row = 0; row < CDG_TILE_ROWS; ++row)
+    {
+        for (int column = 0; column < CDG_TILE_COLUMNS; ++column)
+        {
+            if (m_tileChanged[row][column]) m_changedTiles++;
+        }
+    }
+
+    m_sceneCut = (m_memoryPreset && m_changedTiles > 0) ||
+                 m_changedTiles >= CDG_TILE_ROWS * CDG_TILE_COLUMNS / 2;
+
+    m_repaint = false;
+    m_memoryPreset = false;
 }
 
@@ -33,6 +33,12 @@
 
 #define COLOUR_TABLE_SIZE           16
 
+// The screen is painted in tiles of 6x12 pixels
+#define CDG_TILE_WIDTH              6
+#define CDG_TILE_HEIGHT             12
+#define CDG_TILE_COLUMNS            (CDG_FULL_WIDTH / CDG_TILE_WIDTH)
+#define CDG_TILE_ROWS               (CDG_FULL_HEIGHT / CDG_TILE_HEIGHT)
+
 class ISurface
 {
 public:
@@ -67,8 +73,35 @@ public:
     void close();
 
     bool renderAtPosition(long ms);
+
+    // Process the packets up to 'ms' without rendering them, the next
+    // render shows the screen at that time. Returns false at the end.
+    bool advanceTo(long ms);
+
+    // Duration in miliseconds, 0 if unknown (reading from a pipe) until the end is reached
     long getTotalDuration() { return m_duration; }
 
+    // Duration of a CDG stream in miliseconds, from its size
+    static long getStreamDuration(CdgIoStream* pStream);
+
+    // Scan the stream for the scene resets (memory presets clearing the
+    // screen) without processing the packets, and store up to 'max' of
+    // their times in miliseconds; rendered at such a time the screen is
+    // the page just before the reset. Shall be called before the first
+    // render, the stream is rewound. Returns the number of resets found.
+    int findSceneResets(long* times, int max);
+
+    // Changes of the last rendered frame against the frame rendered before,
+    // per tile of the surface. The first frame after open() is all changed.
+    bool isChanged() { return m_changedTiles > 0; }
+    int  getChangedTiles() { return m_changedTiles; }
+    bool isTileChanged(int row, int column) { return m_tileChanged[row][column]; }
+
+    // The last frame starts a new scene: the screen was cleared with a
+    // memory preset, or at least half of it changed at once (page wipe,
+    // colour table swap). A good place for a key frame.
+    bool isSceneCut() { return m_sceneCut; }
+
 protected:
     bool readPacket(CdgPacket& pack);
     void processPacket(const CdgPacket *packd);
@@ -96,6 +129,12 @@ protected:
     ISurface* m_pSurface;
     long m_positionMs;
     long m_duration;
+
+    bool m_tileChanged[CDG_TILE_ROWS][CDG_TILE_COLUMNS];
+    int m_changedTiles;
+    bool m_repaint;     // the surface was cleared, the next frame is all changed
+    bool m_memoryPreset;    // the screen was cleared since the last frame
+    bool m_sceneCut;
 };
 
 #endif // __INC_CDGFILE_H__
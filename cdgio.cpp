@@ -16,6 +16,7 @@
 */
 
 #include <sys/stat.h>
+#include <unistd.h>
 #include "cdgio.h"
 
 int cdgio_read_packet(void *opaque, uint8_t *buf, int buf_size)
@@ -35,8 +36,9 @@ int64_t cdgio_seek(void *opaque, int64_t offset, int whence)
     CdgIoStream* pStream = (CdgIoStream*)opaque;
 
     if (whence == AVSEEK_SIZE) {
-        // return the filesize without seeking anywhere
-        return pStream->getsize();
+        // return the filesize without seeking anywhere (unknown for pipes)
+        int size = pStream->getsize();
+        return size > 0 ? size : AVERROR(ENOSYS);
     }
 
     whence &= ~AVSEEK_FORCE;
@@ -92,9 +94,22 @@ CdgFileIoStream::~CdgFileIoStream()
 bool CdgFileIoStream::open(const char* file, const char* mode)
 {
     close();
-    m_file = fopen(file, mode);
+
+    // "-" stands for the standard input/output
+    if (strcmp(file, "-") == 0)
+        m_file = (mode[0] == 'r') ? stdin : stdout;
+    else
+        m_file = fopen(file, mode);
+
     if (m_file != NULL) {
         m_filename = strdup(file);
+
+        // pipes can't be seeked, tell libavformat not to try it
+        struct stat results;
+        if (m_avio_ctx && fstat(fileno(m_file), &results) == 0 && !S_ISREG(results.st_mode)) {
+            m_avio_ctx->seekable = 0;
+        }
+
         return true;
     }
 
@@ -103,7 +118,7 @@ bool CdgFileIoStream::open(const char* file, const char* mode)
 
 void CdgFileIoStream::close()
 {
-    if (m_file) fclose(m_file);
+    if (m_file && m_file != stdin && m_file != stdout) fclose(m_file);
     if (m_filename) free(m_filename);
         
     m_file = NULL;
@@ -134,7 +149,7 @@ int CdgFileIoStream::getsize()
 {
     struct stat results;
     
-    if (fstat(fileno(m_file), &results) == 0)
+    if (fstat(fileno(m_file), &results) == 0 && S_ISREG(results.st_mode))
     {
         return results.st_size;
     }
@@ -232,3 +247,427 @@ const char* CdgZipFileIoStream::getfilename()
 {
     return m_filename;
 }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+CdgMemIoStream::CdgMemIoStream()
+{
+    m_data = NULL;
+    m_size = 0;
+    m_pos = 0;
+    m_filename = NULL;
+}
+
+CdgMemIoStream::~CdgMemIoStream()
+{
+    close();
+}
+
+bool CdgMemIoStream::open(const uint8_t* data, int size, const char *fname)
+{
+    close();
+
+    if (data == NULL || fname == NULL)
+    {
+        return false;
+    }
+
+    m_data = data;
+    m_size = size;
+    m_filename = strdup(fname);
+    return true;
+}
+
+void CdgMemIoStream::close()
+{
+    if (m_filename) free(m_filename);
+
+    m_data = NULL;
+    m_size = 0;
+    m_pos = 0;
+    m_filename = NULL;
+}
+
+int CdgMemIoStream::read(void *buf, int buf_size)
+{
+    int left = m_size - m_pos;
+    if (buf_size > left) buf_size = left;
+    if (buf_size <= 0) return 0;
+
+    memcpy(buf, m_data + m_pos, buf_size);
+    m_pos += buf_size;
+    return buf_size;
+}
+
+int CdgMemIoStream::write(const void *buf, int buf_size)
+{
+    return 0;
+}
+
+int CdgMemIoStream::seek(int offset, int whence)
+{
+    int pos;
+
+    switch (whence)
+    {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = m_pos + offset; break;
+    case SEEK_END: pos = m_size + offset; break;
+    default: return -1;
+    }
+
+    if (pos < 0 || pos > m_size) return -1;
+
+    m_pos = pos;
+    return 0;
+}
+
+int CdgMemIoStream::eof()
+{
+    return m_pos >= m_size;
+}
+
+int CdgMemIoStream::getsize()
+{
+    return m_size;
+}
+
+const char* CdgMemIoStream::getfilename()
+{
+    return m_filename;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_ZSTD
+
+#define ZSTD_SKIPPABLE_MAGIC        0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC         0x8F92EAB1
+#define ZSTD_SEEKABLE_FOOTER_SIZE   9
+#define ZSTD_SKIPPABLE_HEADER_SIZE  8
+
+// 10 seconds of CDG packets (24 bytes, 300 packets per second) per frame
+#define CDG_ZSTD_FRAME_SIZE         (24 * 300 * 10)
+
+static uint32_t read_le32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void write_le32(FILE* f, uint32_t v)
+{
+    uint8_t p[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+    fwrite(p, 1, 4, f);
+}
+
+CdgZstdIoStream::CdgZstdIoStream()
+{
+    m_source = NULL;
+    m_dctx = NULL;
+    m_frames = 0;
+    m_compressedOffset = NULL;
+    m_offset = NULL;
+    m_frame = -1;
+    m_buffer = NULL;
+    m_compressed = NULL;
+    m_pos = 0;
+}
+
+CdgZstdIoStream::~CdgZstdIoStream()
+{
+    close();
+}
+
+bool CdgZstdIoStream::open(CdgIoStream* source)
+{
+    close();
+
+    if (source == NULL)
+    {
+        return false;
+    }
+
+    // read the seek table from the end of the file
+    int size = source->getsize();
+    uint8_t footer[ZSTD_SEEKABLE_FOOTER_SIZE];
+
+    if (size < ZSTD_SEEKABLE_FOOTER_SIZE + ZSTD_SKIPPABLE_HEADER_SIZE ||
+        source->seek(size - ZSTD_SEEKABLE_FOOTER_SIZE, SEEK_SET) < 0 ||
+        source->read(footer, ZSTD_SEEKABLE_FOOTER_SIZE) != ZSTD_SEEKABLE_FOOTER_SIZE ||
+        read_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC)
+    {
+        return false;
+    }
+
+    int frames = read_le32(footer);
+    int entry_size = (footer[4] & 0x80) ? 12 : 8;   // with or without checksums
+    int64_t table_size = (int64_t)frames * entry_size;
+
+    if (frames <= 0 || table_size + ZSTD_SEEKABLE_FOOTER_SIZE + ZSTD_SKIPPABLE_HEADER_SIZE > size)
+    {
+        return false;
+    }
+
+    uint8_t* table = (uint8_t*)malloc(table_size);
+    if (source->seek(size - ZSTD_SEEKABLE_FOOTER_SIZE - table_size, SEEK_SET) < 0 ||
+        source->read(table, table_size) != table_size)
+    {
+        free(table);
+        return false;
+    }
+
+    m_compressedOffset = (int*)malloc((frames + 1) * sizeof(int));
+    m_offset = (int*)malloc((frames + 1) * sizeof(int));
+    m_compressedOffset[0] = 0;
+    m_offset[0] = 0;
+
+    int max_compressed = 0, max_frame = 0;
+    for (int i = 0; i < frames; i++)
+    {
+        int compressed = read_le32(table + i*entry_size);
+        int decompressed = read_le32(table + i*entry_size + 4);
+
+        m_compressedOffset[i + 1] = m_compressedOffset[i] + compressed;
+        m_offset[i + 1] = m_offset[i] + decompressed;
+
+        if (compressed > max_compressed) max_compressed = compressed;
+        if (decompressed > max_frame) max_frame = decompressed;
+    }
+    free(table);
+
+    m_frames = frames;
+
+    if (m_compressedOffset[frames] > size - table_size - ZSTD_SEEKABLE_FOOTER_SIZE - ZSTD_SKIPPABLE_HEADER_SIZE)
+    {
+        close();
+        return false;
+    }
+
+    m_dctx = ZSTD_createDCtx();
+    m_compressed = (uint8_t*)malloc(max_compressed > 0 ? max_compressed : 1);
+    m_buffer = (uint8_t*)malloc(max_frame > 0 ? max_frame : 1);
+    m_source = source;
+
+    if (m_dctx == NULL || m_compressed == NULL || m_buffer == NULL)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void CdgZstdIoStream::close()
+{
+    if (m_dctx) ZSTD_freeDCtx(m_dctx);
+    if (m_compressedOffset) free(m_compressedOffset);
+    if (m_offset) free(m_offset);
+    if (m_buffer) free(m_buffer);
+    if (m_compressed) free(m_compressed);
+
+    m_source = NULL;
+    m_dctx = NULL;
+    m_frames = 0;
+    m_compressedOffset = NULL;
+    m_offset = NULL;
+    m_frame = -1;
+    m_buffer = NULL;
+    m_compressed = NULL;
+    m_pos = 0;
+}
+
+bool CdgZstdIoStream::loadFrame(int frame)
+{
+    int compressed = m_compressedOffset[frame + 1] - m_compressedOffset[frame];
+    int decompressed = m_offset[frame + 1] - m_offset[frame];
+
+    m_frame = -1;
+
+    if (m_source->seek(m_compressedOffset[frame], SEEK_SET) < 0 ||
+        m_source->read(m_compressed, compressed) != compressed)
+    {
+        return false;
+    }
+
+    size_t res = ZSTD_decompressDCtx(m_dctx, m_buffer, decompressed, m_compressed, compressed);
+    if (ZSTD_isError(res) || (int)res != decompressed)
+    {
+        return false;
+    }
+
+    m_frame = frame;
+    return true;
+}
+
+int CdgZstdIoStream::read(void *buf, int buf_size)
+{
+    int done = 0;
+
+    while (done < buf_size && m_pos < m_offset[m_frames])
+    {
+        // the frames are read sequentially, so the next frame is usually the right one
+        if (m_frame < 0 || m_pos < m_offset[m_frame] || m_pos >= m_offset[m_frame + 1])
+        {
+            int frame = (m_frame >= 0 && m_pos >= m_offset[m_frame]) ? m_frame : 0;
+            while (m_pos >= m_offset[frame + 1]) frame++;
+
+            if (!loadFrame(frame)) break;
+        }
+
+        int count = m_offset[m_frame + 1] - m_pos;
+        if (count > buf_size - done) count = buf_size - done;
+
+        memcpy((uint8_t*)buf + done, m_buffer + m_pos - m_offset[m_frame], count);
+        done += count;
+        m_pos += count;
+    }
+
+    return done;
+}
+
+int CdgZstdIoStream::write(const void *buf, int buf_size)
+{
+    return 0;
+}
+
+int CdgZstdIoStream::seek(int offset, int whence)
+{
+    int pos;
+
+    switch (whence)
+    {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = m_pos + offset; break;
+    case SEEK_END: pos = m_offset[m_frames] + offset; break;
+    default: return -1;
+    }
+
+    if (pos < 0 || pos > m_offset[m_frames]) return -1;
+
+    m_pos = pos;
+    return 0;
+}
+
+int CdgZstdIoStream::eof()
+{
+    return m_pos >= m_offset[m_frames];
+}
+
+int CdgZstdIoStream::getsize()
+{
+    return m_offset ? m_offset[m_frames] : 0;
+}
+
+const char* CdgZstdIoStream::getfilename()
+{
+    return m_source ? m_source->getfilename() : NULL;
+}
+
+int cdgio_pack_zstd(const char* cdgfile, const char* zstfile, int level)
+{
+    FILE* in = fopen(cdgfile, "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Unable to open file: %s\n", cdgfile);
+        return -1;
+    }
+
+    FILE* out = fopen(zstfile, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open '%s'\n", zstfile);
+        fclose(in);
+        return -1;
+    }
+
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    size_t bound = ZSTD_compressBound(CDG_ZSTD_FRAME_SIZE);
+    uint8_t* src = (uint8_t*)malloc(CDG_ZSTD_FRAME_SIZE);
+    uint8_t* dst = (uint8_t*)malloc(bound);
+
+    uint32_t* table = NULL;   // compressed and decompressed size of each frame
+    int frames = 0, allocated = 0;
+    int64_t total_in = 0, total_out = 0;
+    int res = 0;
+    size_t read;
+
+    while ((read = fread(src, 1, CDG_ZSTD_FRAME_SIZE, in)) > 0)
+    {
+        size_t size = ZSTD_compressCCtx(cctx, dst, bound, src, read, level);
+        if (ZSTD_isError(size))
+        {
+            fprintf(stderr, "Compression error: %s\n", ZSTD_getErrorName(size));
+            res = -1;
+            break;
+        }
+
+        if (fwrite(dst, 1, size, out) != size)
+        {
+            fprintf(stderr, "Unable to write '%s'\n", zstfile);
+            res = -1;
+            break;
+        }
+
+        if (frames == allocated)
+        {
+            allocated = allocated ? allocated * 2 : 64;
+            table = (uint32_t*)realloc(table, allocated * 2 * sizeof(uint32_t));
+        }
+
+        table[frames*2] = size;
+        table[frames*2 + 1] = read;
+        frames++;
+
+        total_in += read;
+        total_out += size;
+    }
+
+    if (ferror(in))
+    {
+        fprintf(stderr, "Unable to read file: %s\n", cdgfile);
+        res = -1;
+    }
+
+    // the seek table, in a skippable frame
+    write_le32(out, ZSTD_SKIPPABLE_MAGIC);
+    write_le32(out, frames*8 + ZSTD_SEEKABLE_FOOTER_SIZE);
+
+    for (int i = 0; i < frames; i++)
+    {
+        write_le32(out, table[i*2]);
+        write_le32(out, table[i*2 + 1]);
+    }
+
+    write_le32(out, frames);
+    fputc(0, out);              // no checksums
+    write_le32(out, ZSTD_SEEKABLE_MAGIC);
+
+    // a full disk shows up here, the table writes aren't checked one by one
+    if (res == 0 && ferror(out))
+    {
+        fprintf(stderr, "Unable to write '%s'\n", zstfile);
+        res = -1;
+    }
+
+    if (fclose(out) != 0) res = -1;
+    fclose(in);
+
+    if (res == 0)
+    {
+        fprintf(stderr, "Packed: %s (%d KB -> %d KB)\n", zstfile,
+                (int)(total_in / 1024), (int)(total_out / 1024));
+    }
+    else
+    {
+        unlink(zstfile);
+    }
+
+    free(table);
+    free(src);
+    free(dst);
+    ZSTD_freeCCtx(cctx);
+
+    return res;
+}
+
+#endif // HAVE_ZSTD
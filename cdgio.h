@@ -23,6 +23,10 @@
 #include <stdio.h>
 #include "ffmpeg_headers.h"
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 class CdgIoStream
 {
 public:
@@ -84,6 +88,71 @@ protected:
     char*  m_filename;
 };
 
+class CdgMemIoStream : public CdgIoStream
+{
+public:
+    CdgMemIoStream();
+    virtual ~CdgMemIoStream();
+    bool open(const uint8_t* data, int size, const char *fname);
+    void close();
+  
+    virtual int read(void *buf, int buf_size);
+    virtual int write(const void *buf, int buf_size);
+    virtual int seek(int offset, int whence);
+    virtual int eof();
+    virtual int getsize();
+    virtual const char* getfilename();
+      
+protected:
+    const uint8_t* m_data;  // not owned by the stream
+    int m_size;
+    int m_pos;
+    char*  m_filename;
+};
+
+#ifdef HAVE_ZSTD
+
+// Zstandard seekable format: the data is split in independent frames,
+// followed by a seek table in a skippable frame, so any position can be
+// reached by decompressing a single frame. The compressed data is read
+// from another stream (file or memory).
+class CdgZstdIoStream : public CdgIoStream
+{
+public:
+    CdgZstdIoStream();
+    virtual ~CdgZstdIoStream();
+    bool open(CdgIoStream* source);
+    void close();
+  
+    virtual int read(void *buf, int buf_size);
+    virtual int write(const void *buf, int buf_size);
+    virtual int seek(int offset, int whence);
+    virtual int eof();
+    virtual int getsize();
+    virtual const char* getfilename();
+
+protected:
+    bool loadFrame(int frame);
+      
+protected:
+    CdgIoStream* m_source;
+    ZSTD_DCtx* m_dctx;
+
+    int  m_frames;
+    int* m_compressedOffset;    // m_frames + 1 entries
+    int* m_offset;              // m_frames + 1 entries, decompressed
+
+    int  m_frame;               // frame in m_buffer, -1 if none
+    uint8_t* m_buffer;
+    uint8_t* m_compressed;
+    int  m_pos;
+};
+
+// Pack a CDG file in the seekable Zstandard format
+int cdgio_pack_zstd(const char* cdgfile, const char* zstfile, int level);
+
+#endif // HAVE_ZSTD
+
 int cdgio_read_packet(void *opaque, uint8_t *buf, int buf_size);
 int cdgio_write_packet(void *opaque, uint8_t *buf, int buf_size);
 int64_t cdgio_seek(void *opaque, int64_t offset, int whence);
@@ -0,0 +1,258 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Client of the cdg2video daemon (cdg2video --daemon). It doesn't link
+// with FFmpeg, so it starts in no time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+static void usage()
+{
+    fprintf(stderr, "Usage: cdg2video-client [OPTIONS] SOCKET CDGFILE...\n"
+        "       cdg2video-client --stats SOCKET\n\n"
+        "Convert the files with a running 'cdg2video --daemon SOCKET'.\n\n"
+        "  -a, --audio=FILE     audio file of the CDG file\n"
+        "  -o, --output=FILE    output file of the CDG file\n"
+        "  -b, --batch          batch job, it gives way to the interactive ones\n"
+        "  -q, --quiet          don't print the progress\n"
+        "      --stats          print the queue wait statistics of the daemon\n"
+        "  -h, --help           this help\n");
+}
+
+// Return the absolute path of 'path', the daemon runs in another directory
+static char* absolute_path(const char* path)
+{
+    char* abs = realpath(path, NULL);
+
+    if (abs == NULL && path[0] != '/')
+    {
+        // the output file doesn't exist yet
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) return NULL;
+
+        abs = (char*)malloc(strlen(cwd) + strlen(path) + 2);
+        sprintf(abs, "%s/%s", cwd, path);
+    }
+    else if (abs == NULL)
+    {
+        abs = strdup(path);
+    }
+
+    return abs;
+}
+
+static int connect_daemon(const char* socket_path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror(socket_path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Send the request and copy the reply to stderr, return the status from
+// the RESULT line
+static int request(const char* socket_path, const char* req, int len, const char* name, bool quiet)
+{
+    int fd = connect_daemon(socket_path);
+    if (fd < 0) return 1;
+
+    if (write(fd, req, len) != len)
+    {
+        fprintf(stderr, "Unable to send the request for %s\n", name);
+        close(fd);
+        return 1;
+    }
+
+    // the output is split at \r as well, so the progress shows up at once
+    char line[4096];
+    int used = 0;
+    int status = -1;
+
+    while (status < 0)
+    {
+        ssize_t res = read(fd, line + used, sizeof(line) - used - 1);
+        if (res <= 0) break;
+
+        used += res;
+        line[used] = '\0';
+
+        char* start = line;
+        char* end;
+
+        while ((end = strpbrk(start, "\r\n")) != NULL)
+        {
+            if (strncmp(start, DAEMON_REPLY_RESULT " ", strlen(DAEMON_REPLY_RESULT) + 1) == 0)
+            {
+                status = atoi(start + strlen(DAEMON_REPLY_RESULT) + 1);
+            }
+            else if (!quiet || *end == '\n')
+            {
+                fwrite(start, 1, end - start + 1, stderr);
+            }
+
+            start = end + 1;
+        }
+
+        used -= start - line;
+        memmove(line, start, used);
+
+        // a line longer than the buffer can't be the result
+        if (used == (int)sizeof(line) - 1)
+        {
+            fwrite(line, 1, used, stderr);
+            used = 0;
+        }
+    }
+
+    close(fd);
+
+    if (status < 0)
+    {
+        fprintf(stderr, "Connection to the daemon lost while processing %s\n", name);
+        return 1;
+    }
+
+    return status;
+}
+
+static int convert(const char* socket_path, const char* cdgfile, const char* audiofile,
+                   const char* outputfile, bool batch, bool quiet)
+{
+    char* cdg = absolute_path(cdgfile);
+    char* audio = audiofile ? absolute_path(audiofile) : NULL;
+    char* output = outputfile ? absolute_path(outputfile) : NULL;
+
+    char req[DAEMON_MAX_REQUEST];
+    int len = snprintf(req, sizeof(req), "%s\t%s\t%s\t%s\t%s\n", DAEMON_REQUEST_CONVERT,
+                       cdg ? cdg : "", audio ? audio : "", output ? output : "",
+                       batch ? DAEMON_PRIORITY_BATCH : DAEMON_PRIORITY_INTERACTIVE);
+
+    free(cdg);
+    free(audio);
+    free(output);
+
+    if (len >= (int)sizeof(req))
+    {
+        fprintf(stderr, "File name too long: %s\n", cdgfile);
+        return 1;
+    }
+
+    return request(socket_path, req, len, cdgfile, quiet);
+}
+
+int main(int argc, char* argv[])
+{
+    static struct option long_options[] =
+    {
+        { "audio", required_argument, 0, 'a' },
+        { "output", required_argument, 0, 'o' },
+        { "batch", no_argument, 0, 'b' },
+        { "quiet", no_argument, 0, 'q' },
+        { "stats", no_argument, 0, 's' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    const char* audiofile = NULL;
+    const char* outputfile = NULL;
+    bool batch = false;
+    bool quiet = false;
+    bool stats = false;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "a:o:bqh", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'a':
+                audiofile = optarg;
+                break;
+            case 'o':
+                outputfile = optarg;
+                break;
+            case 'b':
+                batch = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            case 's':
+                stats = true;
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (stats && argc - optind == 1)
+    {
+        return request(argv[optind], DAEMON_REQUEST_STATS "\n", strlen(DAEMON_REQUEST_STATS) + 1, "stats", false);
+    }
+
+    if (argc - optind < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    if ((audiofile || outputfile) && argc - optind > 2)
+    {
+        fprintf(stderr, "--audio and --output can be used with a single CDG file only\n");
+        return 1;
+    }
+
+    const char* socket_path = argv[optind];
+    int failed = 0;
+
+    for (int i = optind + 1; i < argc; i++)
+    {
+        if (convert(socket_path, argv[i], audiofile, outputfile, batch, quiet) != 0) failed++;
+    }
+
+    return failed ? 1 : 0;
+}
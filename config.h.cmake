@@ -7,5 +7,8 @@
 /* Version number of package */
 #define VERSION "${VERSION}"
 
+/* Seekable zstd compressed CDG files (libzstd) */
+#cmakedefine HAVE_ZSTD 1
+
 
 #endif
@@ -0,0 +1,489 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "jobpool.h"
+#include "daemon.h"
+
+enum
+{
+    PRIORITY_INTERACTIVE = 0,
+    PRIORITY_BATCH,
+    PRIORITY_CLASSES
+};
+
+static const char* priority_names[PRIORITY_CLASSES] = { DAEMON_PRIORITY_INTERACTIVE, DAEMON_PRIORITY_BATCH };
+
+enum
+{
+    CLIENT_READING = 0, // waiting for the request line
+    CLIENT_QUEUED,      // waiting for a free job slot
+    CLIENT_RUNNING      // the conversion runs
+};
+
+typedef struct {
+    int     fd;
+    int     state;
+    char    buf[DAEMON_MAX_REQUEST];
+    int     len;
+    char*   cdgfile;    // point in buf
+    char*   audiofile;
+    char*   outputfile;
+    int     priority;   // PRIORITY_*
+    int64_t queued;
+    int64_t started;
+    pid_t   pid;
+    bool    paused;
+} tClient;
+
+// Queue wait of the jobs, per priority class
+typedef struct {
+    int     count;
+    int64_t total;      // in microseconds
+    int64_t max;
+} tWaitStats;
+
+typedef struct {
+    tDaemonConvertFunc convert;
+    tClient*           client;
+} tJobArgs;
+
+static volatile sig_atomic_t daemon_quit = 0;
+
+static tClient** clients = NULL;
+static int client_count = 0;
+
+static tWaitStats wait_stats[PRIORITY_CLASSES];
+static int preempted = 0;
+
+static void daemon_signal(int sig)
+{
+    daemon_quit = 1;
+}
+
+static void reply(tClient* client, const char* fmt, ...)
+{
+    char line[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    // the client may be gone already, which is not our problem
+    if (write(client->fd, line, len) < 0) {}
+}
+
+static void remove_client(int i)
+{
+    close(clients[i]->fd);
+    free(clients[i]);
+    clients[i] = clients[--client_count];
+}
+
+static void finish_job(tJob* job)
+{
+    double seconds = (jobpool_time() - job->started) / 1000000.0;
+
+    fprintf(stderr, "%s: %s (%.1f s)\n", job->status == 0 ? "Done" : "Failed", job->name, seconds);
+    free(job->name);
+
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i]->state != CLIENT_RUNNING || clients[i]->pid != job->pid) continue;
+
+        reply(clients[i], "%s %d %.1f\n", DAEMON_REPLY_RESULT, job->status, seconds);
+        remove_client(i);
+        break;
+    }
+}
+
+static void format_stats(char* buf, int size)
+{
+    int len = 0;
+
+    for (int i = 0; i < PRIORITY_CLASSES; i++)
+    {
+        tWaitStats* stats = &wait_stats[i];
+
+        len += snprintf(buf + len, size - len, "Queue wait (%s): %d jobs, average %.1f s, max %.1f s\n",
+                        priority_names[i], stats->count,
+                        stats->count ? stats->total / 1000000.0 / stats->count : 0.0,
+                        stats->max / 1000000.0);
+    }
+
+    snprintf(buf + len, size - len, "Batch jobs paused: %d times\n", preempted);
+}
+
+static int run_job(void* arg)
+{
+    tJobArgs* args = (tJobArgs*)arg;
+
+    // the conversion reports to the client, the other connections
+    // belong to the daemon
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i] != args->client) close(clients[i]->fd);
+    }
+
+    dup2(args->client->fd, STDERR_FILENO);
+    close(args->client->fd);
+
+    return args->convert(args->client->cdgfile, args->client->audiofile, args->client->outputfile);
+}
+
+// Split the request line in place, return false if it is not valid
+static bool parse_request(tClient* client)
+{
+    char* fields[5] = { NULL, NULL, NULL, NULL, NULL };
+    char* p = client->buf;
+
+    for (int i = 0; i < 5 && p; i++)
+    {
+        fields[i] = p;
+        p += strcspn(p, "\t");
+
+        if (i < 3 && *p != '\t') return false;
+        if (*p == '\0') p = NULL;
+        else *p++ = '\0';
+    }
+
+    // the daemon runs in another directory, a relative path would be
+    // taken from its own
+    if (strcmp(fields[0], DAEMON_REQUEST_CONVERT) != 0 || fields[1][0] != '/') return false;
+    if ((fields[2][0] && fields[2][0] != '/') || (fields[3][0] && fields[3][0] != '/')) return false;
+
+    client->cdgfile = fields[1];
+    client->audiofile = fields[2][0] ? fields[2] : NULL;
+    client->outputfile = fields[3][0] ? fields[3] : NULL;
+    client->priority = PRIORITY_BATCH;
+
+    if (fields[4] && strcmp(fields[4], DAEMON_PRIORITY_INTERACTIVE) == 0)
+        client->priority = PRIORITY_INTERACTIVE;
+    else
+    if (fields[4] && strcmp(fields[4], DAEMON_PRIORITY_BATCH) != 0)
+        return false;
+
+    return true;
+}
+
+static void read_request(int i)
+{
+    tClient* client = clients[i];
+    ssize_t len = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len - 1);
+
+    if (len <= 0)
+    {
+        remove_client(i);
+        return;
+    }
+
+    client->len += len;
+    client->buf[client->len] = '\0';
+
+    char* eol = strchr(client->buf, '\n');
+
+    if (eol == NULL)
+    {
+        if (client->len < (int)sizeof(client->buf) - 1) return;
+
+        reply(client, "%s 2 0.0\n", DAEMON_REPLY_RESULT);
+        remove_client(i);
+        return;
+    }
+
+    *eol = '\0';
+
+    if (strcmp(client->buf, DAEMON_REQUEST_STATS) == 0)
+    {
+        char stats[512];
+        format_stats(stats, sizeof(stats));
+
+        reply(client, "%s%s 0 0.0\n", stats, DAEMON_REPLY_RESULT);
+        remove_client(i);
+        return;
+    }
+
+    if (!parse_request(client))
+    {
+        reply(client, "Invalid request\n%s 2 0.0\n", DAEMON_REPLY_RESULT);
+        remove_client(i);
+        return;
+    }
+
+    client->state = CLIENT_QUEUED;
+    client->queued = jobpool_time();
+}
+
+// The oldest queued job of the class
+static tClient* next_queued(int priority)
+{
+    tClient* next = NULL;
+
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i]->state == CLIENT_QUEUED && clients[i]->priority == priority &&
+            (next == NULL || clients[i]->queued < next->queued))
+            next = clients[i];
+    }
+
+    return next;
+}
+
+// The running batch job to pause (or resume): the one started last, it has
+// the most work left
+static tClient* find_batch(bool paused)
+{
+    tClient* found = NULL;
+
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i]->state == CLIENT_RUNNING && clients[i]->priority == PRIORITY_BATCH &&
+            clients[i]->paused == paused && (found == NULL || clients[i]->started > found->started))
+            found = clients[i];
+    }
+
+    return found;
+}
+
+static void start_job(JobPool* pool, tDaemonConvertFunc convert, tClient* client)
+{
+    tJobArgs args = { convert, client };
+    tWaitStats* stats = &wait_stats[client->priority];
+    int64_t wait = jobpool_time() - client->queued;
+
+    client->pid = pool->start(client->cdgfile, run_job, &args);
+    client->state = CLIENT_RUNNING;
+    client->started = jobpool_time();
+
+    if (client->pid > 0)
+    {
+        stats->count++;
+        stats->total += wait;
+        if (wait > stats->max) stats->max = wait;
+
+        fprintf(stderr, "Started: %s (%s, queued %.1f s)\n", client->cdgfile,
+                priority_names[client->priority], wait / 1000000.0);
+        return;
+    }
+
+    reply(client, "%s 1 0.0\n", DAEMON_REPLY_RESULT);
+
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i] == client) { remove_client(i); break; }
+    }
+}
+
+// Start the queued jobs: the interactive ones first, pausing batch jobs to
+// make room for them, then the paused batch jobs and the queued ones.
+static void schedule(JobPool* pool, tDaemonConvertFunc convert)
+{
+    for (;;)
+    {
+        tClient* next = next_queued(PRIORITY_INTERACTIVE);
+
+        if (pool->isFull())
+        {
+            tClient* victim = next ? find_batch(false) : NULL;
+            if (victim == NULL || !pool->pause(victim->pid)) break;
+
+            victim->paused = true;
+            preempted++;
+            fprintf(stderr, "Paused: %s\n", victim->cdgfile);
+            continue;
+        }
+
+        if (next == NULL)
+        {
+            tClient* paused = find_batch(true);
+
+            if (paused && pool->resume(paused->pid))
+            {
+                paused->paused = false;
+                fprintf(stderr, "Resumed: %s\n", paused->cdgfile);
+                continue;
+            }
+
+            next = next_queued(PRIORITY_BATCH);
+        }
+
+        if (next == NULL) break;
+
+        start_job(pool, convert, next);
+    }
+}
+
+static int open_socket(const char* socket_path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // a stale socket from a previous run would make bind() fail
+    unlink(socket_path);
+
+    // the requests read and write files as the daemon user, only this
+    // user may connect
+    mode_t mask = umask(0077);
+    bool bound = fd >= 0 && bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(mask);
+
+    if (!bound || listen(fd, 16) < 0)
+    {
+        fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int daemon_serve(const char* socket_path, int jobs, tDaemonConvertFunc convert)
+{
+    int lfd = open_socket(socket_path);
+    if (lfd < 0) return 1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // a client disconnecting shall not kill the daemon
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    JobPool pool;
+    pool.setMaxJobs(jobs);
+
+    fprintf(stderr, "Listening: %s (%d jobs)\n", socket_path, pool.getMaxJobs());
+
+    struct pollfd* pfds = NULL;
+
+    while (!daemon_quit)
+    {
+        schedule(&pool, convert);
+
+        pfds = (struct pollfd*)realloc(pfds, (client_count + 1) * sizeof(struct pollfd));
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+
+        // only the connections still sending their request are watched,
+        // the running ones belong to the job
+        int nfds = 1;
+        for (int i = 0; i < client_count; i++)
+        {
+            pfds[nfds].fd = clients[i]->state == CLIENT_READING ? clients[i]->fd : -1;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            nfds++;
+        }
+
+        int res = poll(pfds, nfds, pool.getRunning() ? 200 : -1);
+
+        if (res > 0)
+        {
+            for (int i = client_count - 1; i >= 0; i--)
+            {
+                if (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) read_request(i);
+            }
+
+            if (pfds[0].revents & POLLIN)
+            {
+                int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+                // the socket mode may have been changed since, check the peer
+                struct ucred cred;
+                socklen_t cred_len = sizeof(cred);
+
+                if (fd >= 0 &&
+                    (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != getuid()))
+                {
+                    fprintf(stderr, "Refused a connection from another user\n");
+                    close(fd);
+                    fd = -1;
+                }
+
+                if (fd >= 0)
+                {
+                    clients = (tClient**)realloc(clients, (client_count + 1) * sizeof(tClient*));
+                    clients[client_count] = (tClient*)calloc(1, sizeof(tClient));
+                    clients[client_count]->fd = fd;
+                    clients[client_count]->state = CLIENT_READING;
+                    client_count++;
+                }
+            }
+        }
+
+        tJob job;
+        while (pool.reap(&job, false))
+        {
+            finish_job(&job);
+        }
+    }
+    // the paused jobs have to finish as well
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i]->state == CLIENT_RUNNING && clients[i]->paused) pool.resume(clients[i]->pid);
+    }
+
+    fprintf(stderr, "Waiting for %d running jobs\n", pool.getRunning());
+
+    tJob job;
+    while (pool.reap(&job, true))
+    {
+        finish_job(&job);
+    }
+
+    while (client_count > 0)
+    {
+        remove_client(client_count - 1);
+    }
+
+    free(clients);
+    free(pfds);
+    close(lfd);
+    unlink(socket_path);
+
+    char stats[512];
+    format_stats(stats, sizeof(stats));
+    fputs(stats, stderr);
+
+    return 0;
+}
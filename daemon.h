@@ -0,0 +1,55 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CDG2VIDEO_DAEMON_H
+#define _CDG2VIDEO_DAEMON_H
+
+// Conversion daemon protocol, over a Unix stream socket.
+//
+// Only the user running the daemon may connect (the socket is created
+// with mode 0600). The client sends one request line, the fields are
+// separated with tabs and the paths shall be absolute (empty for the
+// defaults):
+//  CONVERT <TAB> cdgfile <TAB> audiofile <TAB> outputfile [<TAB> priority] <LF>
+// The priority is "interactive" or "batch" (the default). Interactive jobs
+// start first and, when all the slots are taken, a running batch job is
+// paused until there's a free slot again.
+//
+// The daemon sends back the output of the conversion (the same lines the
+// command line tool writes on stderr, including the progress), followed by
+//  RESULT <SP> status <SP> seconds <LF>
+// where status is 0 if the file was converted.
+//
+//  STATS <LF>
+// returns the queue wait statistics per priority class, followed by a
+// RESULT line.
+
+#define DAEMON_REQUEST_CONVERT      "CONVERT"
+#define DAEMON_REQUEST_STATS        "STATS"
+#define DAEMON_REPLY_RESULT         "RESULT"
+#define DAEMON_PRIORITY_INTERACTIVE "interactive"
+#define DAEMON_PRIORITY_BATCH       "batch"
+#define DAEMON_MAX_REQUEST          (3 * 4096 + 64)
+
+typedef int (*tDaemonConvertFunc)(const char* cdgfile, const char* audiofile, const char* outputfile);
+
+// Accept conversion jobs on 'socket_path' until SIGINT or SIGTERM. Each job
+// runs in a process forked from the daemon, so it starts with the codecs
+// and surfaces already set up by the daemon. Up to 'jobs' run at once.
+int daemon_serve(const char* socket_path, int jobs, tDaemonConvertFunc convert);
+
+#endif // #define _CDG2VIDEO_DAEMON_H
@@ -13,6 +13,8 @@ extern "C" {
   #include "libavutil/imgutils.h"
   #include "libswresample/swresample.h"
   #include "libavutil/audio_fifo.h"
+  #include "libavutil/md5.h"
+  #include "libavutil/parseutils.h"
   #include "libavformat/avio.h"
 }
 
@@ -0,0 +1,79 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __INC_FRAMESINK_H__
+#define __INC_FRAMESINK_H__
+
+#include <inttypes.h>
+#include "cdgfile.h"
+
+struct AVFrame;
+struct AVCodecContext;
+
+// A frame rendered by CDGFile, handed to every frame sink in turn.
+//
+// Ownership: the sink borrows the frame for the duration of writeFrame()
+// only. The next frame is rendered in the same buffers, so a sink keeping
+// the pixels for later (a queue, memory read by another process) copies
+// them. Writing them out from the call, or converting them straight in
+// the sink's own buffers, needs no copy.
+typedef struct {
+    int64_t  pts;           // frame number in the output, at the frame rate
+    int64_t  ms;            // the same in miliseconds
+    bool     key;           // a scene or a segment starts, a key frame is wanted
+    CDGFile* cdg;           // the tiles changed since the previous rendered frame
+    const unsigned long (*rgb32)[CDG_FULL_WIDTH];   // the surface, 0x00RRGGBB
+    AVFrame* rgb24;         // the same as RGB24, if a sink wants it
+} tSinkFrame;
+
+// Output of the rendered frames: the encoders, a shared memory ring, a
+// raw stream... The sinks are opened at the start of the output and closed
+// at its end, a playlist keeps them open from song to song.
+class FrameSink
+{
+public:
+    virtual ~FrameSink() {}
+
+    // 'filename' is the output name of the conversion, the sinks with a
+    // name of their own ignore it. Return false to abort.
+    virtual bool open(const char* filename) = 0;
+    virtual void close() = 0;
+
+    virtual void writeFrame(const tSinkFrame* frame) = 0;
+
+    // The frame shall come with rgb24 (see tSinkFrame)
+    virtual bool wantsRgb24() { return false; }
+};
+
+// Output of the audio samples, the counterpart of FrameSink. The samples
+// come in frames of the format given to open(): the audio encoder input,
+// or the input audio decoder when the audio is copied in the output (the
+// encoder sink is skipped then). The frame is borrowed for the duration of
+// writeAudio() only.
+class AudioSink
+{
+public:
+    virtual ~AudioSink() {}
+
+    virtual bool open(const AVCodecContext* format) = 0;
+    virtual void close() = 0;
+
+    // Return false to abort
+    virtual bool writeAudio(const AVFrame* samples) = 0;
+};
+
+#endif // __INC_FRAMESINK_H__
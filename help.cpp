@@ -57,6 +57,7 @@ void print_help(const char* optarg)
 {
     printf("%s Version %s, convert CDG files to video\n", PACKAGE, VERSION);
     printf("Usage: %s [OPTION]... CDGFILE...\n", PACKAGE);
+    printf("Use '-' as CDGFILE to read the CDG stream from the standard input.\n");
 
     if (optarg == NULL)
     {
@@ -73,6 +74,55 @@ void print_help(const char* optarg)
       printf("     --aspect   <ratio>     Set aspect ratio (4:3, 16:9 or 1.3333, 1.7777, default: 4:3)\n");
       
       printf(" -r             <rate>      Set frame rate (Hz value, fraction or abbreviation, default: pal)\n");
+      printf("     --vfr                  Variable frame rate: write a frame only when the screen changes\n");
+      printf("                            (matroska, mp4 and mov only). -r sets the time resolution.\n");
+      printf("     --max-frame-gap <sec>  Longest time without a frame in --vfr mode (default: 2)\n");
+      printf("     --scene-gop[=<sec>]    Put the key frames where the CDG screen is cleared or repainted,\n");
+      printf("                            with GOPs up to <sec> seconds long (default: 10)\n");
+      printf("     --mb-align             Scale the CDG screen by whole factors that fit in the frame size\n");
+      printf("                            and pad it to whole macroblocks (the aspect goes in the SAR)\n");
+      printf("     --rc-plan              Analyse the CDG file before encoding and guide the rate control\n");
+      printf("                            with it, to keep the peaks within the rate limits (MPEG-1/2/4 codecs)\n");
+      printf("     --rendition <size>[:<kbit/s>]\n");
+      printf("                            Write one more output file with this frame size (and bit rate),\n");
+      printf("                            named <output>-<W>x<H>.<ext>. The CDG file is rendered and the\n");
+      printf("                            audio is encoded once for all of them. Can be repeated\n");
+      printf("     --tee <format>         Write the same encoded streams in one more output format too,\n");
+      printf("                            with the extension of the format (mp4, mpegts, matroska...).\n");
+      printf("                            The codecs are the ones of -f. Can be repeated\n");
+      printf("     --segment-time <sec>   Segment duration of the hls format (-f hls or --tee hls), which\n");
+      printf("                            writes the segments and the playlist while encoding (default: 4)\n");
+      printf("     --live                 Convert in real time for a player reading the output: every\n");
+      printf("                            packet is written at once, the encoder is set up for low latency\n");
+      printf("                            and the output latency is reported at the end\n");
+      printf("     --playlist             Convert the CDG files one after the other in one continuous\n");
+      printf("                            output (the one of the first file, -o or --stdout), without\n");
+      printf("                            restarting the encoders. The next file is read while the current\n");
+      printf("                            one plays, the songs without audio get silence. Without --live,\n");
+      printf("                            a chapter is added at the start of every song (mp4, matroska),\n");
+      printf("                            the other formats (vcd, dvd...) get the list in <output>.chapters\n");
+      printf("     --shm <name>           Publish the rendered CDG frames (32 bit RGB, with the changed\n");
+      printf("                            tiles) in a POSIX shared memory ring for local readers, see\n");
+      printf("                            shmring.h for the layout. Use -f null to skip the encoding\n");
+      printf("     --raw-video <file>     Write the uncompressed frames in the YUV4MPEG2 format too (- for\n");
+      printf("                            the standard output). On a pipe the frames are spliced without\n");
+      printf("                            a copy\n");
+      printf("     --raw-audio <file>     Write the uncompressed audio (16 bit WAV) too, the reader shall\n");
+      printf("                            read it at the same time as the raw video. A copied audio\n");
+      printf("                            stays copied in the output, it's decoded for the WAV only\n");
+      printf("     --null                 Render the CDG frames only, without scaling or encoding them,\n");
+      printf("                            and report the rendering speed (frames per second, realtime)\n");
+      printf("     --frame-hash <file>    Write the MD5 of every rendered frame (framemd5 layout, - for the\n");
+      printf("                            standard output), to check that the rendering is unchanged\n");
+      printf("     --thumbnails <times>   Write the frames at these times (comma separated seconds) as\n");
+      printf("                            images instead of converting the file, \"auto\" picks the pages\n");
+      printf("                            of the song. The names are the output name with -NN.png\n");
+      printf("     --thumbnail-count <n>  Number of pages picked by --thumbnails auto (default: 6)\n");
+      printf("     --thumbnail-format <f> Image format of the thumbnails, png or webp (default: png)\n");
+      printf("     --contact-sheet[=<n>]  Tile the thumbnails in one -sheet image, n per row (default: 4)\n");
+      printf("     --start <time>         Encode from this point of the song ([[hh:]mm:]ss[.xxx]), the\n");
+      printf("                            CDG and the audio are skipped to it and the output starts at 0\n");
+      printf("     --duration <time>      Encode this much of the song only\n");
 
       printf("\n");
       printf("     --acodec   <codec>     Force audio codec\n");
@@ -80,11 +130,38 @@ void print_help(const char* optarg)
 	  
       printf("\n");
       printf("     --stdout               Redirect video output to standard output\n");
+      printf(" -o  --output   <file>      Set the output file name (single CDGFILE only)\n");
+      printf("     --audio    <file>      Set the audio file name (single CDGFILE only)\n");
       printf("     --force-encode-audio   By default, if the input audio codec is the same as the output one,\n");
       printf("                            the audio is copied. If you specify this option the audio will be\n");
       printf("                            re-encode always. This can helps in case of corrupted audio files,\n");
       printf("                            but it's possible to reduce the audio quality.\n");
 
+      printf("\nBatch options:\n");
+      printf(" -R  --recursive            Scan the directories given on the command line recursively and\n");
+      printf("                            convert every CDG file found, paired with its audio file.\n");
+      printf("     --manifest <file>      Keep a list of the converted files (paths, sizes and times).\n");
+      printf("                            Unchanged files already converted by a previous run are skipped.\n");
+      printf("     --song-list <file>     Convert the songs of the list, one per line in playing order\n");
+      printf("                            (CDGFILE, or CDGFILE<TAB>AUDIOFILE), as one --playlist\n");
+      printf("     --prefetch <n>         Read the input files of the next <n> songs in memory while the\n");
+      printf("                            current song is converted (default: 0, disabled).\n");
+      printf("     --prefetch-budget <mb> Memory limit for the prefetched files in MB (default: 256).\n");
+      printf("     --watch                Watch the directories given on the command line and convert\n");
+      printf("                            every new CDG+audio pair (or zip file) as soon as both files are\n");
+      printf("                            written. Use -R to watch the subdirectories as well.\n");
+      printf("     --daemon <socket>      Serve conversion requests on a Unix socket, with the encoders\n");
+      printf("                            and the scaler set up once for the output options given.\n");
+      printf("                            Use cdg2video-client to send the files. Interactive requests\n");
+      printf("                            pause the batch ones (cdg2video-client --batch) when all the\n");
+      printf("                            jobs are busy.\n");
+      printf(" -j  --jobs     <n>         Number of conversions running at the same time in --watch and\n");
+      printf("                            --daemon mode (default: one per CPU)\n");
+#ifdef HAVE_ZSTD
+      printf("     --pack-zstd[=<level>]  Pack the CDG files in the seekable zstd format (*.cdg.zst)\n");
+      printf("                            instead of converting them (default level: 19).\n");
+#endif
+
       print_abbreviation();
     }
     
@@ -0,0 +1,206 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "jobpool.h"
+
+static volatile sig_atomic_t job_paused = 0;
+
+static void pause_signal(int sig)
+{
+    job_paused = (sig == SIGUSR1);
+}
+
+void jobpool_check_pause()
+{
+    if (!job_paused) return;
+
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+
+    while (job_paused)
+    {
+        sigsuspend(&old);
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+int64_t jobpool_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+JobPool::JobPool()
+{
+    m_jobs = NULL;
+    m_count = 0;
+    m_paused = 0;
+    m_maxJobs = 0;
+
+    setMaxJobs(1);
+}
+
+JobPool::~JobPool()
+{
+    waitAll();
+    free(m_jobs);
+}
+
+void JobPool::setMaxJobs(int maxJobs)
+{
+    if (maxJobs < 1) maxJobs = 1;
+
+    m_maxJobs = maxJobs;
+}
+
+pid_t JobPool::start(const char* name, tJobFunc func, void* arg)
+{
+    if (isFull()) return -1;
+
+    // don't let the child write out what's buffered in the parent
+    fflush(stdout);
+    fflush(stderr);
+
+    // the pause signals wait until the child has its handler
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+
+    pid_t pid = fork();
+
+    if (pid < 0)
+    {
+        fprintf(stderr, "Unable to start a job: %s\n", strerror(errno));
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = pause_signal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sa, NULL);
+        sigaction(SIGUSR2, &sa, NULL);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+
+        int res = func(arg);
+
+        fflush(stdout);
+        fflush(stderr);
+        _exit(res == 0 ? 0 : 1);
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    m_jobs = (tJob*)realloc(m_jobs, (m_count + 1) * sizeof(tJob));
+
+    tJob* job = &m_jobs[m_count++];
+    job->pid = pid;
+    job->name = strdup(name);
+    job->started = jobpool_time();
+    job->status = -1;
+    job->paused = false;
+
+    return pid;
+}
+
+bool JobPool::reap(tJob* finished, bool block)
+{
+    while (m_count > 0)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+
+        if (pid == 0) return false;
+        if (pid < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        tJob* job = find(pid);
+        if (job == NULL) continue;
+
+        *finished = *job;
+        finished->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+        if (job->paused) m_paused--;
+        *job = m_jobs[--m_count];
+        return true;
+    }
+
+    return false;
+}
+
+tJob* JobPool::find(pid_t pid)
+{
+    for (int i = 0; i < m_count; i++)
+    {
+        if (m_jobs[i].pid == pid) return &m_jobs[i];
+    }
+
+    return NULL;
+}
+
+bool JobPool::pause(pid_t pid)
+{
+    tJob* job = find(pid);
+
+    if (job == NULL || job->paused || kill(pid, SIGUSR1) != 0) return false;
+
+    job->paused = true;
+    m_paused++;
+    return true;
+}
+
+bool JobPool::resume(pid_t pid)
+{
+    tJob* job = find(pid);
+
+    if (job == NULL || !job->paused || kill(pid, SIGUSR2) != 0) return false;
+
+    job->paused = false;
+    m_paused--;
+    return true;
+}
+
+void JobPool::waitAll()
+{
+    tJob job;
+
+    while (reap(&job, true))
+    {
+        free(job.name);
+    }
+}
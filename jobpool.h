@@ -0,0 +1,83 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __INC_JOBPOOL_H__
+#define __INC_JOBPOOL_H__
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+// The conversion keeps its state in globals, so every job runs in its own
+// process, forked from the caller. The pool limits the number of jobs
+// running at the same time.
+//
+// A job can be paused to give its CPU to a more urgent one. The job stops
+// at the next jobpool_check_pause() call, between two frames, and goes on
+// with its state intact when it's resumed. Paused jobs don't count in the
+// limit.
+
+typedef int (*tJobFunc)(void* arg);
+
+typedef struct {
+    pid_t   pid;
+    char*   name;
+    int64_t started;    // in microseconds
+    int     status;     // exit status, valid after the job has finished
+    bool    paused;
+} tJob;
+
+class JobPool
+{
+public:
+    JobPool();
+    ~JobPool();
+
+    void setMaxJobs(int maxJobs);
+    int  getMaxJobs() { return m_maxJobs; }
+    int  getRunning() { return m_count; }
+    int  getActive() { return m_count - m_paused; }
+    bool isFull() { return getActive() >= m_maxJobs; }
+
+    // Fork a child running func(arg) and return its pid, -1 on error.
+    // The call doesn't wait for a free slot, check isFull() first.
+    pid_t start(const char* name, tJobFunc func, void* arg);
+
+    // Collect a finished job. If 'block' is false and no job has finished,
+    // return false. The caller shall free finished->name.
+    bool reap(tJob* finished, bool block);
+
+    // Wait for all the running jobs
+    void waitAll();
+
+    bool pause(pid_t pid);
+    bool resume(pid_t pid);
+
+protected:
+    tJob* find(pid_t pid);
+
+    tJob* m_jobs;
+    int   m_count;
+    int   m_paused;
+    int   m_maxJobs;
+};
+
+int64_t jobpool_time();
+
+// Called by the job between the frames, sleeps while the job is paused
+void jobpool_check_pause();
+
+#endif // __INC_JOBPOOL_H__
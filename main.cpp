@@ -26,11 +26,22 @@
 #include <string.h>
 #include <math.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "ffmpeg_headers.h"
 #include "cdgfile.h"
 #include "help.h"
 #include "utils.h"
+#include "scanner.h"
+#include "prefetch.h"
+#include "watch.h"
+#include "daemon.h"
+#include "jobpool.h"
+#include "shmring.h"
+#include "rawsink.h"
+#include "framesink.h"
+#include "thumbnail.h"
 
 enum
 {
@@ -40,7 +51,36 @@ enum
   OPTIONID_ASPECT,
   OPTIONID_SHOW_FORMATS,
   OPTIONID_SHOW_CODECS,
-  OPTIONID_STDOUT
+  OPTIONID_STDOUT,
+  OPTIONID_MANIFEST,
+  OPTIONID_PREFETCH,
+  OPTIONID_PREFETCH_BUDGET,
+  OPTIONID_AUDIO,
+  OPTIONID_PACK_ZSTD,
+  OPTIONID_WATCH,
+  OPTIONID_DAEMON,
+  OPTIONID_VFR,
+  OPTIONID_MAX_FRAME_GAP,
+  OPTIONID_SCENE_GOP,
+  OPTIONID_MB_ALIGN,
+  OPTIONID_RC_PLAN,
+  OPTIONID_RENDITION,
+  OPTIONID_TEE,
+  OPTIONID_SEGMENT_TIME,
+  OPTIONID_LIVE,
+  OPTIONID_PLAYLIST,
+  OPTIONID_SONG_LIST,
+  OPTIONID_SHM,
+  OPTIONID_RAW_VIDEO,
+  OPTIONID_RAW_AUDIO,
+  OPTIONID_NULL,
+  OPTIONID_FRAME_HASH,
+  OPTIONID_THUMBNAILS,
+  OPTIONID_THUMBNAIL_COUNT,
+  OPTIONID_THUMBNAIL_FORMAT,
+  OPTIONID_CONTACT_SHEET,
+  OPTIONID_START,
+  OPTIONID_DURATION
 };
 
 class VideoFrameSurface : public ISurface
@@ -80,12 +120,44 @@ typedef struct
     int video_min_rate;
     int video_buffer_size;
     int video_codec_flags;
+    int vfr;                    // write a frame only when the screen changes
+    float max_frame_gap;        // longest time without a frame in vfr mode, in seconds
+    int scene_gop;              // key frames at the CDG scene cuts
+    float max_gop;              // longest GOP in scene_gop mode, in seconds
+    int mb_align;               // integer scaling, the CDG screen on the macroblock grid
+    int rc_plan;                // analyse the CDG file first, to guide the rate control
+    float segment_time;         // segment duration of the hls format, in seconds
 
     // misc
 
     int packet_size;
     float mux_preload;    	// demux-decode delay in seconds
     int video_stdout;		// use "/dev/stdout" as a video file name
+    int live;                   // real time output, each packet written at once
+    int playlist;               // the files follow each other in one output
+    const char* shm_name;       // publish the rendered frames in this shared memory ring
+    const char* raw_video;      // uncompressed video output (Y4M)...
+    const char* raw_audio;      // ...and audio output (WAV)
+    int null_sink;              // render only, nothing is encoded
+    const char* frame_hash;     // MD5 of every rendered frame, in this file
+    tThumbnailOptions thumbnails; // picked frames as images instead of a video
+    int64_t clip_start;         // encode from this point of the song...
+    int64_t clip_duration;      // ...for this long (0 - to the end), in miliseconds
+    const char* output_file;    // output file name, for a single input file
+    const char* audio_file;     // audio file name, for a single input file
+
+    // batch
+
+    int recursive;              // scan directories given on the command line
+    const char* manifest;       // manifest of the already converted files
+    const char* song_list;      // songs of a playlist, in playing order
+    int prefetch_depth;         // number of jobs to read in advance
+    int64_t prefetch_budget;    // memory limit for the jobs read in advance, in bytes
+    int pack_zstd;              // pack the CDG files in the seekable zstd format
+    int zstd_level;             // compression level for the packed files
+    int watch;                  // watch the directories for new files
+    int jobs;                   // conversions running at the same time, 0 - one per CPU
+    const char* daemon_socket;  // serve the conversion requests on this Unix socket
 
 }tOptions;
 
@@ -109,22 +181,210 @@ static tOptions Options =
     0,          // video min rate
     0,          // video buffer size
     0,          // video codec flags
+    0,          // --vfr
+    2.0,        // --max-frame-gap
+    0,          // --scene-gop
+    10.0,       // longest GOP with --scene-gop
+    0,          // --mb-align
+    0,          // --rc-plan
+    4.0,        // --segment-time
 
     0,          // packet_size
     0.5,        // demux-decode delay in seconds
-    0		// use "/dev/stdout" as a video file name
+    0,		// use "/dev/stdout" as a video file name
+    0,          // --live
+    0,          // --playlist
+    NULL,       // --shm
+    NULL,       // --raw-video
+    NULL,       // --raw-audio
+    0,          // --null
+    NULL,       // --frame-hash
+    {NULL, 6, 0, "png"}, // --thumbnails, --thumbnail-count, --contact-sheet, --thumbnail-format
+    0,          // --start
+    0,          // --duration
+    NULL,       // --output
+    NULL,       // --audio
+
+    0,          // --recursive
+    NULL,       // --manifest
+    NULL,       // --song-list
+    0,          // --prefetch
+    256 << 20,  // --prefetch-budget
+    0,          // --pack-zstd
+    19,         // zstd compression level
+    0,          // --watch
+    0,          // --jobs
+    NULL        // --daemon
 };
 
 
 static CDGFile cdgfile;
 static VideoFrameSurface frameSurface;
 
-static AVFrame *picture, *tmp_picture;
-static struct SwsContext *img_convert_ctx;
+// The rendered frames and the audio samples go to the sinks, see
+// framesink.h. The encoders are the first sink of each list, --shm,
+// --raw-video and --raw-audio add more.
+#define MAX_SINKS       4
+
+static FrameSink *frame_sinks[MAX_SINKS];
+static int frame_sink_count;
+static AudioSink *audio_sinks[MAX_SINKS];
+static int audio_sink_count;
+static int audio_sinks_from;    // 1 when the audio is copied, past the encoder
+static bool audio_sinks_open;
+
+// Every file of a batch uses the same Options, so the encoders, the
+// pictures, the scaler and the audio buffers are set up for the first file
+// and kept for the next ones (see close_profile).
+
+typedef struct {
+    AVCodecContext *ctx;
+    bool flushed;       // the delayed frames were drained, reopen it for the next file
+    int64_t next_pts;   // the encoder expects increasing timestamps...
+    int64_t pts_offset; // ...so they go on from the previous file and are shifted back
+} tEncoder;
+
+static tEncoder audio_enc;
 
 static AVAudioFifo *audio_fifo;
+static int64_t audio_clip_ts = AV_NOPTS_VALUE;  // clip start, in the input audio time base
+static bool audio_clip_pending;                 // the first frame after the seek is not decoded yet
+static int64_t audio_drain;                     // decoded samples before the clip start, to drop
 static SwrContext *audio_resample_ctx; 
 
+// Video encoding of the current file
+typedef struct {
+    int     frames;
+    int64_t time;       // spent in the encoder, in microseconds
+} tEncodeStats;
+
+// Output file of a rendition, in one of the output formats
+typedef struct {
+    AVFormatContext *oc;
+    AVStream *video_st;
+    AVStream *audio_st;
+    AVBitStreamFilterContext *video_bsf;    // repeats the global header in-band
+} tOutput;
+
+// The encoded packets are written in every output format: the one of -f,
+// and the ones added by --tee
+#define MAX_FORMATS     4
+
+static AVOutputFormat *formats[MAX_FORMATS];
+static int format_count = 1;
+
+// Output picture size and bit rate, with its own video encoder and scaler.
+// The first rendition is the one of -s and the format, --rendition adds
+// more. The CDG frame is rendered once for all of them, the audio is
+// encoded once and muxed in every output file.
+typedef struct {
+    int width;
+    int height;
+    int video_bit_rate;
+
+    tEncoder video_enc;
+    AVFrame *picture;
+    AVFrame *tmp_picture;       // the scaled RGB frame with --mb-align
+    struct SwsContext *img_convert_ctx;
+
+    // With --mb-align every CDG pixel becomes a scale_x * scale_y block of
+    // the output picture, 0 when the screen is resampled to the frame size
+    int scale_x, scale_y;
+
+    tEncodeStats video_stats;
+
+    // output files of the current conversion, one per format
+    tOutput outputs[MAX_FORMATS];
+} tRendition;
+
+#define MAX_RENDITIONS  8
+
+static tRendition renditions[MAX_RENDITIONS];
+static int rendition_count = 1;
+
+// The rendered CDG frame in RGB, the renditions scale it to their size
+static AVFrame *rgb_picture;
+
+// Rate plan of the current file: the change density of every second of
+// the CDG stream, measured by a decode-only pass (see analyse_cdg)
+static int *rc_plan;
+static int rc_plan_seconds;
+
+// A scene cut costs about as much as repainting the whole screen
+#define RC_PLAN_CUT_WEIGHT  (CDG_TILE_ROWS * CDG_TILE_COLUMNS)
+
+// Peak to average bit rate allowed by the plan when the format has no maximum rate
+#define RC_PLAN_PEAK        2.0
+
+// The quiet seconds cost little, they get a finer quantizer
+#define RC_PLAN_QUIET       0.5
+#define RC_PLAN_QUIET_QF    0.8
+#define RC_PLAN_MAX_QF      4.0
+
+// Live mode: the frames are due at live_start plus their time in the song.
+// The delay from then until the packet is written in the output is kept
+// for every video frame, for the report at the end.
+static int64_t live_start;
+
+// Live playlist: the last frames of a song go out this much ahead of time,
+// in miliseconds. The next song's audio input and decoder are opened at
+// the boundary, on this thread, the player plays the lead meanwhile.
+#define PLAYLIST_LEAD   500
+static int64_t *live_latency;
+static int live_samples;
+
+// avcodec_open2 takes the options it uses out of the dictionary, the
+// encoder options are kept for the next opening
+static int open_codec(AVCodecContext *c, AVCodec *codec, const AVDictionary *opts)
+{
+    AVDictionary *copy = NULL;
+
+    av_dict_copy(&copy, opts, 0);
+    int res = avcodec_open2(c, codec, &copy);
+    av_dict_free(&copy);
+
+    return res;
+}
+
+// Open the encoder of the profile with the parameters set up in 'params',
+// or get it ready for the next file. An encoder with delayed frames can't
+// take more frames after it was flushed, so it's reopened. The others are
+// used as they are.
+static bool open_encoder(tEncoder *enc, AVCodecContext *params, const AVDictionary *opts)
+{
+    AVCodec *codec = avcodec_find_encoder(params->codec_id);
+    if (!codec) return false;
+
+    if (enc->ctx == NULL) {
+        enc->ctx = avcodec_alloc_context3(codec);
+        if (!enc->ctx || avcodec_copy_context(enc->ctx, params) < 0) return false;
+
+        // the daemon opens the encoders before it forks the jobs, the worker
+        // threads of an encoder (libx264 starts them by default) don't
+        // exist in the forked process and the first encode would hang
+        if (Options.daemon_socket) enc->ctx->thread_count = 1;
+
+        if (open_codec(enc->ctx, codec, opts) < 0) return false;
+    }
+    else
+    if (enc->flushed) {
+        avcodec_close(enc->ctx);
+        if (open_codec(enc->ctx, codec, opts) < 0) return false;
+        enc->next_pts = 0;
+    }
+
+    enc->flushed = false;
+    enc->pts_offset = enc->next_pts;
+
+    // the muxer takes the parameters (and the global header) from the stream
+    return avcodec_copy_context(params, enc->ctx) >= 0;
+}
+
+static void close_encoder(tEncoder *enc)
+{
+    avcodec_free_context(&enc->ctx);
+}
+
 static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt)
 {
     /* rescale output packet timestamp values from codec to stream timebase */
@@ -132,7 +392,94 @@ static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AV
     pkt->stream_index = st->index;
 
     /* Write the compressed frame to the media file. */
-    return av_interleaved_write_frame(fmt_ctx, pkt);
+    if (!Options.live)
+        return av_interleaved_write_frame(fmt_ctx, pkt);
+
+    // live: the packets come in real time, they go out at once without
+    // waiting in the interleaving queue or in the output buffer
+    int ret = av_write_frame(fmt_ctx, pkt);
+    if (fmt_ctx->pb) avio_flush(fmt_ctx->pb);
+
+    return ret;
+}
+
+// The encoders are shared by the output formats, they write the stream
+// headers separately if any of the formats wants it
+static bool want_global_header()
+{
+    for (int i = 0; i < format_count; i++) {
+        if (formats[i]->flags & AVFMT_GLOBALHEADER) return true;
+    }
+
+    return false;
+}
+
+// VCD, SVCD and DVD players want a fixed geometry and short GOPs
+static bool want_disc_stream()
+{
+    for (int i = 0; i < format_count; i++) {
+        const char *name = formats[i]->name;
+        if (strcmp(name, "vcd") == 0 || strcmp(name, "svcd") == 0 ||
+            strcmp(name, "dvd") == 0 || strcmp(name, "vob") == 0) return true;
+    }
+
+    return false;
+}
+
+// Run the packet through the bitstream filter of an output, the filtered
+// data replaces the packet data
+static int filter_packet(AVBitStreamFilterContext *bsf, AVCodecContext *c, AVPacket *pkt)
+{
+    AVPacket filtered = *pkt;
+    int res = av_bitstream_filter_filter(bsf, c, NULL, &filtered.data, &filtered.size,
+                                         pkt->data, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+
+    if (res == 0 && filtered.data != pkt->data) {
+        // the filter points in a buffer of its own, it has to be copied
+        uint8_t *data = (uint8_t*)av_malloc(filtered.size + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (!data) return AVERROR(ENOMEM);
+
+        memcpy(data, filtered.data, filtered.size);
+        memset(data + filtered.size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+        filtered.data = data;
+        res = 1;
+    }
+
+    if (res <= 0) return res;
+
+    filtered.buf = av_buffer_create(filtered.data, filtered.size + FF_INPUT_BUFFER_PADDING_SIZE,
+                                    av_buffer_default_free, NULL, 0);
+    if (!filtered.buf) {
+        av_free(filtered.data);
+        return AVERROR(ENOMEM);
+    }
+
+    // the side data goes with the filtered packet
+    pkt->side_data = NULL;
+    pkt->side_data_elems = 0;
+    av_free_packet(pkt);
+
+    *pkt = filtered;
+    return 0;
+}
+
+// Write a copy of the packet in an output file, the packet is written in
+// several of them and write_frame changes the timestamps
+static int write_output_packet(tOutput *out, AVStream *st, AVCodecContext *c, const AVRational *time_base, AVPacket *pkt)
+{
+    AVPacket copy;
+
+    if (av_copy_packet(&copy, pkt) < 0) return AVERROR(ENOMEM);
+
+    int error = 0;
+    if (st == out->video_st && out->video_bsf)
+        error = filter_packet(out->video_bsf, c, &copy);
+
+    if (error >= 0)
+        error = write_frame(out->oc, time_base, st, &copy);
+
+    av_free_packet(&copy);
+    return error;
 }
 
 // add audio stream, as a copy of is
@@ -170,7 +517,7 @@ static AVStream *add_audio_stream(AVFormatContext *oc, AVStream* is)
         c->time_base = is->time_base;
 
     // some formats want stream headers to be separate
-    if (oc->oformat->flags & AVFMT_GLOBALHEADER) 
+    if (want_global_header()) 
         c->flags |= CODEC_FLAG_GLOBAL_HEADER;
 
     return st;
@@ -252,7 +599,7 @@ static AVStream *add_audio_stream(AVFormatContext *oc, AVCodecID codec_id)
 
     st->time_base = (AVRational){1, c->sample_rate};
 
-    if (oc->oformat->flags & AVFMT_GLOBALHEADER) 
+    if (want_global_header()) 
         c->flags |= CODEC_FLAG_GLOBAL_HEADER;
 
     return st;
@@ -262,24 +609,19 @@ static AVStream *add_audio_stream(AVFormatContext *oc, AVCodecID codec_id)
 static void open_audio(AVFormatContext *oc, AVStream *st)
 {
     AVCodecContext *c;
-    AVCodec *codec;
 
     c = st->codec;
 
-    // find the audio encoder
-    codec = avcodec_find_encoder(c->codec_id);
-    if (!codec) {
-        fprintf(stderr, "Output audio codec not found (ID: 0x%08X)\n", c->codec_id);
-        exit(1);
-    }
-
-    // open it
-    if (avcodec_open2(c, codec, NULL) < 0) {
+    // open the encoder, or reuse the one of the previous file
+    if (!open_encoder(&audio_enc, c, NULL)) {
         fprintf(stderr, "Could not open output audio codec (ID: 0x%08X)\n", c->codec_id);
         exit(1);
     }
 
-    audio_fifo = av_audio_fifo_alloc(st->codec->sample_fmt, st->codec->channels, 1);
+    if (audio_fifo)
+        av_audio_fifo_reset(audio_fifo);
+    else
+        audio_fifo = av_audio_fifo_alloc(c->sample_fmt, c->channels, 1);
 }
 
 static int init_converted_samples(uint8_t ***converted_input_samples,
@@ -342,7 +684,7 @@ static int add_samples_to_fifo(AVAudioFifo *fifo,
     return 0;
 }
 
-static int decode_audio_frame(AVFormatContext *ic, AVStream* is, AVStream* os, int *finished)
+static int decode_audio_frame(AVFormatContext *ic, AVStream* is, int *finished)
 {
     int error = AVERROR_EXIT;
     int data_present = 0;
@@ -387,9 +729,18 @@ static int decode_audio_frame(AVFormatContext *ic, AVStream* is, AVStream* os, i
         goto cleanup;
     }
 
+    if (data_present && audio_clip_pending) {
+        // the seek lands on a packet before the clip start, the samples
+        // up to it are dropped from the fifo
+        if (input_frame->pkt_pts != AV_NOPTS_VALUE)
+            audio_drain = av_rescale_q(audio_clip_ts - input_frame->pkt_pts, is->time_base,
+                                       av_make_q(1, audio_enc.ctx->sample_rate));
+        audio_clip_pending = false;
+    }
+
     if (data_present) {
 
-        if (init_converted_samples(&converted_input_samples, os->codec, input_frame->nb_samples))
+        if (init_converted_samples(&converted_input_samples, audio_enc.ctx, input_frame->nb_samples))
             goto cleanup;
 
         if (convert_samples((const uint8_t**)input_frame->extended_data, converted_input_samples,
@@ -400,6 +751,11 @@ static int decode_audio_frame(AVFormatContext *ic, AVStream* is, AVStream* os, i
                                 input_frame->nb_samples))
             goto cleanup;
 
+        if (audio_drain > 0) {
+            int drained = (int)FFMIN(audio_drain, av_audio_fifo_size(audio_fifo));
+            av_audio_fifo_drain(audio_fifo, drained);
+            audio_drain -= drained;
+        }
     }
 
     error = 0;
@@ -417,10 +773,24 @@ cleanup:
     return error;
 }
 
-static int encode_audio_frame(AVFrame *frame,
-                              AVFormatContext *oc,
-                              AVStream* os,
-                              int *data_present)
+// Write an audio packet in every output file of every rendition
+static int write_audio_packet(const AVRational *time_base, AVPacket *pkt)
+{
+    for (int i = 0; i < rendition_count; i++) {
+        for (int j = 0; j < format_count; j++) {
+            tOutput *out = &renditions[i].outputs[j];
+
+            if (out->audio_st == NULL) continue;
+
+            int error = write_output_packet(out, out->audio_st, audio_enc.ctx, time_base, pkt);
+            if (error < 0) return error;
+        }
+    }
+
+    return 0;
+}
+
+static int encode_audio_frame(AVFrame *frame, int *data_present)
 {
     int error;
     AVPacket output_packet;
@@ -429,14 +799,14 @@ static int encode_audio_frame(AVFrame *frame,
     output_packet.data = NULL;
     output_packet.size = 0;
 
-    if ((error = avcodec_encode_audio2(os->codec, &output_packet, frame, data_present)) < 0) {
+    if ((error = avcodec_encode_audio2(audio_enc.ctx, &output_packet, frame, data_present)) < 0) {
         fprintf(stderr, "Could not encode audio frame\n");
         av_free_packet(&output_packet);
         return error;
     }
 
     if (*data_present) {
-        if ((error = write_frame(oc, &os->codec->time_base, os, &output_packet)) < 0) {
+        if ((error = write_audio_packet(&audio_enc.ctx->time_base, &output_packet)) < 0) {
             fprintf(stderr, "Could not write audio frame\n");
             av_free_packet(&output_packet);
             return error;
@@ -474,16 +844,21 @@ static int init_output_frame(AVFrame **frame,
     return 0;
 }
 
-static int encode_audio_from_fifo(AVAudioFifo *fifo,
-                                 AVFormatContext *oc,
-                                 AVStream *os, 
-                                 int nb_samples)
+// Hand the samples to the open audio sinks, a failed sink ends the job
+static void write_sink_audio(const AVFrame *samples)
+{
+    for (int i = audio_sinks_from; i < audio_sink_count && audio_sinks_open; i++) {
+        if (!audio_sinks[i]->writeAudio(samples))
+            exit(1);
+    }
+}
+
+static int encode_audio_from_fifo(AVAudioFifo *fifo, int nb_samples)
 {
     AVFrame *output_frame;
-    int data_written;
     const int frame_size = FFMIN(av_audio_fifo_size(fifo), nb_samples);
 
-    if (init_output_frame(&output_frame, os->codec, frame_size))
+    if (init_output_frame(&output_frame, audio_enc.ctx, frame_size))
         return AVERROR_EXIT;
 
     if (av_audio_fifo_read(fifo, (void **)output_frame->data, frame_size) < frame_size) {
@@ -492,55 +867,130 @@ static int encode_audio_from_fifo(AVAudioFifo *fifo,
         return AVERROR_EXIT;
     }
 
-    if (encode_audio_frame(output_frame, oc, os, &data_written)) {
-        av_frame_free(&output_frame);
-        return AVERROR_EXIT;
-    }
+    // the audio encoder is the first sink
+    write_sink_audio(output_frame);
 
     av_frame_free(&output_frame);
     return 0;
 }
 
-// Read frame from the input stream, decode it, re-encode it and write it in the output stream
-// return - 0 if ok and != 0 if eof
-static int write_audio_frame(AVFormatContext *ic, AVStream* is, AVFormatContext *oc, AVStream* os)
+// Encode the frames waiting in the fifo, the last one even if it isn't full
+static void encode_fifo_frames(bool last)
 {
-    if (!ic || !is || !oc || !os) return 1;
-
-    int finished = 0;
-    int ret = decode_audio_frame(ic, is, os, &finished);
-
-    int nb_samples = os->codec->frame_size;
-    if (os->codec->codec->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE) {
+    int nb_samples = audio_enc.ctx->frame_size;
+    if (audio_enc.ctx->codec->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE) {
         nb_samples = av_audio_fifo_size(audio_fifo);
         if (nb_samples <= 0) nb_samples = 1;
     }
 
     while (av_audio_fifo_size(audio_fifo) >= nb_samples || 
-            (finished && av_audio_fifo_size(audio_fifo) > 0))
+            (last && av_audio_fifo_size(audio_fifo) > 0))
     {
-        if (encode_audio_from_fifo(audio_fifo, oc, os, nb_samples)) break;
+        if (encode_audio_from_fifo(audio_fifo, nb_samples)) break;
     }
+}
 
-    if (finished) {
-        // Flush the encoder as it may have delayed frames.
-        int data_written = 0;
-        do {
-            if (encode_audio_frame(NULL, oc, os, &data_written)) break;
-        } while (data_written);        
-    }
+// Encode the rest of the fifo and flush the encoder, as it may have
+// delayed frames
+static void flush_audio()
+{
+    encode_fifo_frames(true);
+
+    int data_written = 0;
+    do {
+        if (encode_audio_frame(NULL, &data_written)) break;
+    } while (data_written);        
+
+    audio_enc.flushed = true;
+}
+
+// Read frame from the input stream, decode it, re-encode it and write it in the output stream
+// return - 0 if ok and != 0 if eof
+static int write_audio_frame(AVFormatContext *ic, AVStream* is)
+{
+    if (!ic || !is) return 1;
+
+    int finished = 0;
+    int ret = decode_audio_frame(ic, is, &finished);
+
+    // in a playlist the encoder goes on with the audio of the next song
+    bool last = finished && !Options.playlist;
+
+    encode_fifo_frames(last);
+
+    if (last)
+        flush_audio();
 
     return ret;
 }
 
+// Playlist: fill the audio up to 'ms' with silence, when the song has no
+// audio or it's shorter than the CDG stream. The audio of the next song
+// starts then in time with its first frame.
+static int pad_audio(AVStream *st, int64_t ms)
+{
+    AVCodecContext *c = audio_enc.ctx;
+    int64_t samples = ms * c->sample_rate / 1000 -
+                      st->pts.val * c->sample_rate * st->time_base.num / st->time_base.den -
+                      av_audio_fifo_size(audio_fifo);
+
+    if (samples <= 0) return 0;
+
+    uint8_t **silence = NULL;
+    int error = init_converted_samples(&silence, c, (int)samples);
+    if (error) return error;
+
+    av_samples_set_silence(silence, 0, (int)samples, c->channels, c->sample_fmt);
+    error = add_samples_to_fifo(audio_fifo, silence, (int)samples);
+
+    av_freep(&silence[0]);
+    free(silence);
+
+    if (error == 0)
+        encode_fifo_frames(false);
+
+    return error;
+}
+
 // close output audio codec 
-static void close_audio(AVFormatContext *oc, AVStream *st)
+static void close_audio(AVStream *st)
+{
+    // the encoder and the fifo are kept for the next file, the stream
+    // only has a copy of the parameters
+    av_freep(&st->codec->extradata);
+}
+
+// The audio is copied in the output: decode the packet for the other
+// audio sinks only (--raw-audio), the output keeps the original stream
+static void decode_copied_audio(AVStream* is, AVPacket *pkt)
 {
-    avcodec_close(st->codec);
-    av_audio_fifo_free(audio_fifo);
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL) {
+        fprintf(stderr, "Could not allocate input frame\n");
+        exit(1);
+    }
+
+    AVPacket input = *pkt;
+    while (input.size > 0) {
+        int got_frame = 0;
+        int len = avcodec_decode_audio4(is->codec, frame, &got_frame, &input);
+
+        if (len < 0) {
+            fprintf(stderr, "Could not decode audio frame\n");
+            break;
+        }
+
+        if (got_frame)
+            write_sink_audio(frame);
+
+        input.data += len;
+        input.size -= len;
+    }
+
+    av_frame_free(&frame);
 }
 
-static int copy_audio_frame(AVFormatContext *ic, AVStream* is, AVFormatContext *oc, AVStream* os)
+static int copy_audio_frame(AVFormatContext *ic, AVStream* is)
 {
     int ret;
     AVPacket pkt;
@@ -549,18 +999,49 @@ static int copy_audio_frame(AVFormatContext *ic, AVStream* is, AVFormatContext *
     pkt.data = NULL;
     pkt.size = 0;
 
-    if (!ic || !is || !oc || !os) 
+    if (!ic || !is) 
         return 1;
 
     ret = av_read_frame(ic, &pkt);
 
+    if (ret == 0 && audio_clip_ts != AV_NOPTS_VALUE) {
+        // clip: the packets before the start are dropped, the others
+        // are moved to start at zero
+        if (pkt.pts != AV_NOPTS_VALUE && pkt.pts < audio_clip_ts) {
+            av_free_packet(&pkt);
+            return 0;
+        }
+
+        if (pkt.pts != AV_NOPTS_VALUE) pkt.pts -= audio_clip_ts;
+        if (pkt.dts != AV_NOPTS_VALUE) pkt.dts -= audio_clip_ts;
+    }
+
     if (ret == 0) {
-        write_frame(oc, &is->time_base, os, &pkt);
+        if (audio_sinks_open)
+            decode_copied_audio(is, &pkt);
+
+        write_audio_packet(&is->time_base, &pkt);
         av_free_packet(&pkt);   
     }
 
     return ret;
 }
+
+// Clip: seek the input audio to 'ms', the audio before it is dropped
+static void seek_input_audio(AVFormatContext *ic, AVStream* is, int64_t ms)
+{
+    audio_clip_ts = av_rescale_q(ms, av_make_q(1, 1000), is->time_base);
+    if (is->start_time != AV_NOPTS_VALUE) audio_clip_ts += is->start_time;
+
+    // without a seek it's decoded from the start, and dropped up to the clip
+    if (av_seek_frame(ic, is->index, audio_clip_ts, AVSEEK_FLAG_BACKWARD) < 0)
+        fprintf(stderr, "WARNING: Unable to seek in the audio file\n");
+    else
+        avcodec_flush_buffers(is->codec);
+
+    audio_clip_pending = true;
+    audio_drain = 0;
+}
  
 static AVStream* open_input_audio(CdgIoStream* pAudioStream, AVFormatContext **ic)
 {
@@ -620,8 +1101,8 @@ static void close_input_audio(AVFormatContext *ic, AVStream* is)
     if (ic) avformat_close_input(&ic);
 }
 
-// Add video output stream
-static AVStream *add_video_stream(AVFormatContext *oc, AVCodecID codec_id)
+// Add video output stream of the rendition
+static AVStream *add_video_stream(AVFormatContext *oc, AVCodecID codec_id, tRendition *r)
 {
     AVCodecContext *c;
     AVStream *st;
@@ -638,20 +1119,45 @@ static AVStream *add_video_stream(AVFormatContext *oc, AVCodecID codec_id)
     c->codec_type = AVMEDIA_TYPE_VIDEO;
     c->flags |= Options.video_codec_flags;
 
-    c->bit_rate           = Options.video_bit_rate;
+    c->bit_rate           = r->video_bit_rate;
     c->bit_rate_tolerance = c->bit_rate * 20;
 
-    c->rc_max_rate    = Options.video_max_rate;
-    c->rc_min_rate    = Options.video_min_rate;
-    c->rc_buffer_size = Options.video_buffer_size;
+    // the rate limits of the format go with the bit rate of the rendition
+    double rate_scale = Options.video_bit_rate ? (double)r->video_bit_rate / Options.video_bit_rate : 1.0;
+
+    c->rc_max_rate    = (int)(Options.video_max_rate * rate_scale);
+    c->rc_min_rate    = (int)(Options.video_min_rate * rate_scale);
+    c->rc_buffer_size = (int)(Options.video_buffer_size * rate_scale);
 
     // resolution must be a multiple of two
-    c->width   = Options.width;
-    c->height  = Options.height;
+    c->width   = r->width;
+    c->height  = r->height;
     c->pix_fmt = Options.frame_pix_fmt;
 
     // calculate pixel aspect ratio
-    c->sample_aspect_ratio = av_d2q(av_q2d(Options.aspect_ratio)*Options.height/Options.width, 255);
+    c->sample_aspect_ratio = av_d2q(av_q2d(Options.aspect_ratio)*r->height/r->width, 255);
+
+    if (Options.mb_align) {
+        // the largest integer scale factors that fit in the frame size, the
+        // frame is padded to whole macroblocks and the screen starts on the
+        // first one, so the tile edges don't get blurred over the neighbour
+        // macroblocks. The padded frame stays within the frame size too.
+        r->scale_x = FFMAX(1, r->width / CDG_FULL_WIDTH);
+        r->scale_y = FFMAX(1, r->height / CDG_FULL_HEIGHT);
+
+        while (r->scale_x > 1 && FFALIGN(CDG_FULL_WIDTH * r->scale_x, 16) > r->width) r->scale_x--;
+        while (r->scale_y > 1 && FFALIGN(CDG_FULL_HEIGHT * r->scale_y, 16) > r->height) r->scale_y--;
+
+        c->width  = FFALIGN(CDG_FULL_WIDTH * r->scale_x, 16);
+        c->height = FFALIGN(CDG_FULL_HEIGHT * r->scale_y, 16);
+
+        // the display aspect ratio is kept by the pixel aspect ratio
+        c->sample_aspect_ratio = av_d2q(av_q2d(Options.aspect_ratio) * CDG_FULL_HEIGHT * r->scale_y /
+                                        (CDG_FULL_WIDTH * r->scale_x), 255);
+
+        fprintf(stderr, "Frame size: %dx%d (CDG screen scaled %dx%d)\n", c->width, c->height, r->scale_x, r->scale_y);
+    }
+
     st->sample_aspect_ratio = c->sample_aspect_ratio;
 
     // time base: this is the fundamental unit of time (in seconds) in terms
@@ -665,6 +1171,27 @@ static AVStream *add_video_stream(AVFormatContext *oc, AVCodecID codec_id)
 
     c->gop_size = 12; // emit one intra frame every twelve frames at most
 
+    if (Options.live) {
+        // every frame leaves the encoder as soon as it's encoded
+        c->max_b_frames = 0;
+        c->thread_type = FF_THREAD_SLICE;
+    }
+
+    if (Options.scene_gop) {
+        // the key frames are forced at the scene cuts found in the CDG stream,
+        // the GOP goes on across the static parts and the encoder doesn't
+        // need to look for scene changes itself
+        c->gop_size = FFMAX(1, (int)(Options.max_gop * Options.frame_rate.num / Options.frame_rate.den));
+
+        // the disc players take up to 15 frames per GOP in PAL, 18 in NTSC,
+        // the scene cuts still get their key frames
+        if (want_disc_stream())
+            c->gop_size = FFMIN(c->gop_size, Options.frame_rate.num == 25 * Options.frame_rate.den ? 15 : 18);
+
+        // libx264 turns the detection off with 0, the others with a huge threshold
+        c->scenechange_threshold = (codec_id == AV_CODEC_ID_H264) ? 0 : 1000000000;
+    }
+
     if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
     }
 
@@ -679,7 +1206,7 @@ static AVStream *add_video_stream(AVFormatContext *oc, AVCodecID codec_id)
     c->rc_initial_buffer_occupancy = c->rc_buffer_size*3/4;
 
     // some formats want stream headers to be separate
-    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+    if (want_global_header())
         c->flags |= CODEC_FLAG_GLOBAL_HEADER;
 
     return st;
@@ -701,75 +1228,164 @@ static AVFrame *alloc_picture(PixelFormat pix_fmt, int width, int height)
     return picture;
 }
 
-// Open output video stram
-static void open_video(AVFormatContext *oc, AVStream *st)
+// Open output video stram of the rendition
+static void open_video(tRendition *r, AVStream *st)
 {
-    AVCodec *codec;
     AVCodecContext *c;
 
     c = st->codec;
 
-    // find the video encoder
-    codec = avcodec_find_encoder(c->codec_id);
-    if (!codec) {
-        fprintf(stderr, "Video codec not found (ID: 0x%08X)\n", c->codec_id);
-        exit(1);
-    }
+    AVDictionary *opts = NULL;
+
+    // libx264 without lookahead and frame threads
+    if (Options.live)
+        av_dict_set(&opts, "tune", "zerolatency", 0);
 
-    // open the codec
-    if (avcodec_open2(c, codec, NULL) < 0) {
+    // open the encoder, or reuse the one of the previous file
+    if (!open_encoder(&r->video_enc, c, opts)) {
         fprintf(stderr, "Could not open video codec (ID: 0x%08X)\n", c->codec_id);
         exit(1);
     }
 
-    // allocate the encoded raw picture
-    picture = alloc_picture(c->pix_fmt, c->width, c->height);
-    if (!picture) {
+    av_dict_free(&opts);
+
+    // allocate the encoded raw picture, unless it's kept from the previous file
+    if (!r->picture) r->picture = alloc_picture(c->pix_fmt, c->width, c->height);
+    if (!r->picture) {
         fprintf(stderr, "Could not allocate picture\n");
         exit(1);
     }
 
-    // tmp_picture is used for conversion between internal frame format,
-    // wich is RGB32 with a constant size and the output frame format
-    tmp_picture = alloc_picture(PIX_FMT_RGB24, CDG_FULL_WIDTH, CDG_FULL_HEIGHT);
-    if (!tmp_picture) {
+    // The RGB pictures are used for conversion between internal frame format,
+    // wich is RGB32 with a constant size and the output frame format.
+    // rgb_picture has the CDG frame, shared by the renditions. With
+    // --mb-align the rendition has its own, already scaled and padded to
+    // the output size, so the conversion only changes the colour format.
+    AVFrame **tmp_picture = r->scale_x ? &r->tmp_picture : &rgb_picture;
+    int tmp_width = r->scale_x ? c->width : CDG_FULL_WIDTH;
+    int tmp_height = r->scale_y ? c->height : CDG_FULL_HEIGHT;
+
+    if (!*tmp_picture) *tmp_picture = alloc_picture(PIX_FMT_RGB24, tmp_width, tmp_height);
+    if (!*tmp_picture) {
         fprintf(stderr, "Could not allocate temporary picture\n");
         exit(1);
     }
 
-    // create image convert context used to convert between tmp_picture and picture
-    img_convert_ctx = sws_getContext(CDG_FULL_WIDTH, CDG_FULL_HEIGHT,
+    // create image convert context used to convert between the RGB picture and picture
+    r->img_convert_ctx = sws_getCachedContext(r->img_convert_ctx,
+                                     tmp_width, tmp_height,
                                      PIX_FMT_RGB24,
                                      c->width, c->height,
                                      c->pix_fmt,
-                                     SWS_BICUBIC, NULL, NULL, NULL);
+                                     r->scale_x ? SWS_POINT : SWS_BICUBIC, NULL, NULL, NULL);
 
-    if (img_convert_ctx == NULL) {
+    if (r->img_convert_ctx == NULL) {
         fprintf(stderr, "Cannot initialize the conversion context\n");
         exit(1);
     }
 }
 
-static void write_video_frame(AVFormatContext *oc, AVStream *st)
+// Write an encoded video packet in every output file of the rendition,
+// with the timestamps of the file
+static void write_video_packet(tRendition *r, AVPacket *pkt)
 {
-    AVCodecContext *c;
-    c = st->codec;
+    if (pkt->pts != AV_NOPTS_VALUE) pkt->pts -= r->video_enc.pts_offset;
+    if (pkt->dts != AV_NOPTS_VALUE) pkt->dts -= r->video_enc.pts_offset;
+
+    AVRational time_base = r->video_enc.ctx->time_base;
+    int64_t pts = pkt->pts;
+
+    for (int i = 0; i < format_count; i++) {
+        tOutput *out = &r->outputs[i];
+
+        if (write_output_packet(out, out->video_st, r->video_enc.ctx, &time_base, pkt) < 0) {
+            fprintf(stderr, "Error while writing video frame\n");
+            exit(1);
+        }
+    }
+
+    if (Options.live && r == &renditions[0] && pts != AV_NOPTS_VALUE) {
+        int64_t due = live_start + pts * 1000000 * time_base.num / time_base.den;
+
+        live_latency = (int64_t*)realloc(live_latency, (live_samples + 1) * sizeof(int64_t));
+        live_latency[live_samples++] = jobpool_time() - due;
+    }
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    int64_t d = *(const int64_t*)a - *(const int64_t*)b;
+    return d < 0 ? -1 : (d > 0 ? 1 : 0);
+}
+
+// Report the delay from the frame time to the packet written in the output,
+// the latency of the player comes on top of it
+static void report_live_latency()
+{
+    if (live_samples == 0) return;
+
+    qsort(live_latency, live_samples, sizeof(int64_t), compare_latency);
+
+    fprintf(stderr, "Live latency: %.1f ms median, %.1f ms p90, %.1f ms p99, %.1f ms max (%d frames)\n",
+            live_latency[live_samples / 2] / 1000.0,
+            live_latency[live_samples * 90 / 100] / 1000.0,
+            live_latency[live_samples * 99 / 100] / 1000.0,
+            live_latency[live_samples - 1] / 1000.0, live_samples);
+
+    free(live_latency);
+    live_latency = NULL;
+    live_samples = 0;
+}
+
+// Copy the rendered CD+G frame to rgb_picture, once for all the renditions
+static void copy_cdg_frame()
+{
+    if (!rgb_picture) return;
 
-    // Copy CD+G frame to a temporary frame object - tmp_picture
     for (int height = 0; height < CDG_FULL_HEIGHT; height++) {
         for (int width = 0, x=0; width < CDG_FULL_WIDTH; width++, x+=3) {
-            tmp_picture->data[0][height*tmp_picture->linesize[0] + x]     =
+            rgb_picture->data[0][height*rgb_picture->linesize[0] + x]     =
                                     (uint8_t)(frameSurface.rgbData[height][width] >> 16);
-            tmp_picture->data[0][height*tmp_picture->linesize[0] + x + 1] =
+            rgb_picture->data[0][height*rgb_picture->linesize[0] + x + 1] =
                                     (uint8_t)(frameSurface.rgbData[height][width] >> 8);
-            tmp_picture->data[0][height*tmp_picture->linesize[0] + x + 2] =
+            rgb_picture->data[0][height*rgb_picture->linesize[0] + x + 2] =
                                     (uint8_t)(frameSurface.rgbData[height][width]);
         }
     }
+}
+
+// Encode the rendered frame for the rendition, 'pts' is in the codec time
+// base. With 'key' the frame is encoded as a key frame.
+static void write_video_frame(tRendition *r, int64_t pts, bool key)
+{
+    AVCodecContext *c;
+    c = r->video_enc.ctx;
+
+    AVFrame *tmp_picture = rgb_picture;
+    AVFrame *picture = r->picture;
+
+    if (r->scale_x) {
+        // Scale the CD+G frame by pixel replication, the padding gets the
+        // colour of the nearest screen edge pixel
+        tmp_picture = r->tmp_picture;
+
+        for (int y = 0; y < c->height; y++) {
+            int height = FFMIN(y / r->scale_y, CDG_FULL_HEIGHT - 1);
+            uint8_t *line = tmp_picture->data[0] + y*tmp_picture->linesize[0];
+
+            for (int x = 0; x < c->width; x++, line += 3) {
+                int width = FFMIN(x / r->scale_x, CDG_FULL_WIDTH - 1);
+
+                line[0] = (uint8_t)(frameSurface.rgbData[height][width] >> 16);
+                line[1] = (uint8_t)(frameSurface.rgbData[height][width] >> 8);
+                line[2] = (uint8_t)(frameSurface.rgbData[height][width]);
+            }
+        }
+    }
 
     // As the CDG frame is RGB, convert it to the output color format and scale the image
-    sws_scale(img_convert_ctx, tmp_picture->data, tmp_picture->linesize,
-                      0, CDG_FULL_HEIGHT, picture->data, picture->linesize);
+    sws_scale(r->img_convert_ctx, tmp_picture->data, tmp_picture->linesize,
+                      0, r->scale_y ? c->height : CDG_FULL_HEIGHT, picture->data, picture->linesize);
 
     // Encode frame
     int got_packet = 0;
@@ -779,124 +1395,321 @@ static void write_video_frame(AVFormatContext *oc, AVStream *st)
     pkt.data= NULL;
     pkt.size= 0;
 
-    if (avcodec_encode_video2(c, &pkt, picture, &got_packet) == 0 && got_packet == 1) {
+    picture->pts = r->video_enc.pts_offset + pts;
+    picture->pict_type = key ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    r->video_enc.next_pts = picture->pts + 1;
+
+    int64_t start = jobpool_time();
+    int res = avcodec_encode_video2(c, &pkt, picture, &got_packet);
+
+    r->video_stats.time += jobpool_time() - start;
+    r->video_stats.frames++;
+
+    if (res == 0 && got_packet == 1) {
         // write the compressed frame in the media file
-        if (write_frame(oc, &c->time_base, st, &pkt) < 0) {
-            fprintf(stderr, "Error while writing video frame\n");
-            exit(1);            
-        }
+        write_video_packet(r, &pkt);
     } 
 
     av_free_packet(&pkt);
 }
 
-static void close_video(AVFormatContext *oc, AVStream *st)
+// Write out the frames the encoder delayed (B-frames, lookahead)
+static void flush_video(tRendition *r)
 {
-    avcodec_close(st->codec);
+    AVCodecContext *c = r->video_enc.ctx;
+
+    if (!(c->codec->capabilities & CODEC_CAP_DELAY)) return;
+
+    int got_packet;
+    do {
+        AVPacket pkt;
+
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        got_packet = 0;
 
-    av_free(picture->data[0]);
-    av_frame_free(&picture);
-    av_free(tmp_picture->data[0]);
-    av_frame_free(&tmp_picture);
+        int64_t start = jobpool_time();
+        int res = avcodec_encode_video2(c, &pkt, NULL, &got_packet);
 
-    sws_freeContext(img_convert_ctx);
+        r->video_stats.time += jobpool_time() - start;
+        if (res < 0) break;
+
+        if (got_packet) write_video_packet(r, &pkt);
+
+        av_free_packet(&pkt);
+    } while (got_packet);
+
+    r->video_enc.flushed = true;
 }
 
-int cdg2avi(const char* avifile, CdgIoStream* pAudioStream)
+static void close_video(AVStream *st)
 {
-    AVFormatContext *oc = NULL;
-    AVFormatContext *ic = NULL;
-    AVStream *video_st = NULL;
-    AVStream *audio_st = NULL;
-    AVStream *in_audio_st = NULL;
-    bool copy_audio = false;
+    // the encoder, the pictures and the scaler are kept for the next file,
+    // the stream only has a copy of the parameters
+    av_freep(&st->codec->extradata);
+}
 
-    if (pAudioStream) {
-        in_audio_st = open_input_audio(pAudioStream, &ic);
-        if (in_audio_st == NULL) {
-            if (ic == NULL)
-                fprintf(stderr, "WARNING: Unable to allocate context for audio file: %s\n", pAudioStream->getfilename());
-            else
-                fprintf(stderr, "WARNING: Unable to find input audio stream in %s\n", pAudioStream->getfilename());
-        }
+// Free what the files of the batch shared
+static void free_picture(AVFrame **picture)
+{
+    if (*picture) {
+        av_free((*picture)->data[0]);
+        av_frame_free(picture);
     }
+}
 
-    // allocate the output media context
-    oc = avformat_alloc_context();
-    if (!oc) {
-        fprintf(stderr, "Memory error\n");
-        exit(1);
-    } 
+static void close_profile()
+{
+    for (int i = 0; i < rendition_count; i++) {
+        tRendition *r = &renditions[i];
 
-    oc->oformat = Options.format;
-    snprintf(oc->filename, sizeof(oc->filename), "%s", avifile);
+        close_encoder(&r->video_enc);
+        free_picture(&r->picture);
+        free_picture(&r->tmp_picture);
 
-    if (Options.format->video_codec != AV_CODEC_ID_NONE) {
-        video_st = add_video_stream(oc, Options.format->video_codec);
+        sws_freeContext(r->img_convert_ctx);
+        r->img_convert_ctx = NULL;
     }
 
-    if (in_audio_st && Options.format->audio_codec != AV_CODEC_ID_NONE) 
-    {
-        if (Options.format->audio_codec == in_audio_st->codec->codec_id) {
-            copy_audio = true;
-        }
-        
-        if (Options.audio_encode_always) {
-            copy_audio = false; 
+    close_encoder(&audio_enc);
+    free_picture(&rgb_picture);
+
+    if (audio_fifo) {
+        av_audio_fifo_free(audio_fifo);
+        audio_fifo = NULL;
+    }
+
+    if (audio_resample_ctx)
+        swr_free(&audio_resample_ctx);
+
+
+    free(rc_plan);
+    rc_plan = NULL;
+    rc_plan_seconds = 0;
+}
+
+// Open the encoders of the output profile once, before the daemon takes
+// any job. The forked jobs start with the encoders open and the pictures
+// and the scaler allocated.
+static void warm_up_profile()
+{
+    for (int r = 0; r < rendition_count; r++) {
+        AVFormatContext *oc = avformat_alloc_context();
+        if (!oc) {
+            fprintf(stderr, "Memory error\n");
+            exit(1);
         }
-    
-        if (copy_audio) {
-            audio_st = add_audio_stream(oc, in_audio_st);
+
+        oc->oformat = Options.format;
+
+        AVStream *video_st = add_video_stream(oc, Options.format->video_codec, &renditions[r]);
+        open_video(&renditions[r], video_st);
+        close_video(video_st);
+
+        // the audio encoder is shared by the renditions
+        if (r == 0) {
+            AVStream *audio_st = add_audio_stream(oc, Options.format->audio_codec);
+            open_audio(oc, audio_st);
+            close_audio(audio_st);
         }
-        else {
-            audio_st = add_audio_stream(oc, Options.format->audio_codec);
+
+        for(unsigned int i = 0; i < oc->nb_streams; i++) {
+            av_freep(&oc->streams[i]->codec);
+            av_freep(&oc->streams[i]);
         }
+
+        av_free(oc);
     }
+}
 
-    av_dump_format(oc, 0, avifile, 1);
+// Decode-only first pass: render the CDG stream at the output frame rate
+// and sum up the changed tiles and the scene cuts of every second. The
+// stream is rewound and reopened for the conversion.
+static bool analyse_cdg(CdgIoStream* pStream)
+{
+    free(rc_plan);
+    rc_plan = NULL;
+    rc_plan_seconds = 0;
 
-    if (video_st)
-        open_video(oc, video_st);
+    // the stream is read twice, a pipe or a zip member can't be rewound
+    if (pStream->getsize() == 0 || pStream->seek(0, SEEK_SET) < 0) {
+        fprintf(stderr, "WARNING: Can't plan the rate control of a stream that can't be rewound\n");
+        return true;
+    }
 
-    audio_resample_ctx = NULL;
+    AVRational frame_rate = Options.frame_rate;
+    int64_t start = jobpool_time();
+    int64_t frame = 0;
+    long pts = 0;
 
-    if (copy_audio == false && audio_st) {
-        open_audio(oc, audio_st);
+    while (cdgfile.renderAtPosition(pts))
+    {
+        int second = (int)(frame * frame_rate.den / frame_rate.num);
 
-        // Create a resampler context for the conversion
-        audio_resample_ctx = swr_alloc_set_opts(NULL, 
-                                    audio_st->codec->channel_layout,    
-                                    audio_st->codec->sample_fmt,    
-                                    audio_st->codec->sample_rate,
-                                    in_audio_st->codec->channel_layout, 
-                                    in_audio_st->codec->sample_fmt, 
-                                    in_audio_st->codec->sample_rate,
-                                    0, NULL);
+        if (second >= rc_plan_seconds) {
+            rc_plan = (int*)realloc(rc_plan, (second + 1) * sizeof(int));
+            memset(rc_plan + rc_plan_seconds, 0, (second + 1 - rc_plan_seconds) * sizeof(int));
+            rc_plan_seconds = second + 1;
+        }
 
-        if (!audio_resample_ctx) {
-            fprintf(stderr, "Can't resample audio.  Aborting.\n");
-            exit(1);
+        rc_plan[second] += cdgfile.getChangedTiles();
+        if (cdgfile.isSceneCut()) rc_plan[second] += RC_PLAN_CUT_WEIGHT;
+
+        frame++;
+        pts = 1000 * frame * frame_rate.den / frame_rate.num;
+    }
+
+    fprintf(stderr, "Rate plan: %d s analysed in %.2f s\n", rc_plan_seconds,
+            (jobpool_time() - start) / 1000000.0);
+
+    return pStream->seek(0, SEEK_SET) >= 0 && cdgfile.open(pStream, &frameSurface);
+}
+
+// Turn the plan into quality factor overrides of the encoder rate control.
+// The seconds that would need more than the peak rate (the maximum rate of
+// the format, or twice the bit rate) get a coarser quantizer in proportion,
+// so the busy parts don't drain the buffer, the quiet ones a finer
+// quantizer. The encoder numbers the frames from its opening, so the
+// overrides are shifted by the frames of the previous files.
+static void apply_rc_plan(tRendition *r)
+{
+    AVCodecContext *c = r->video_enc.ctx;
+
+    av_freep(&c->rc_override);
+    c->rc_override_count = 0;
+
+    if (rc_plan_seconds == 0) return;
+
+    double mean = 0;
+    for (int i = 0; i < rc_plan_seconds; i++) mean += rc_plan[i];
+    mean /= rc_plan_seconds;
+
+    if (mean == 0) return;
+
+    double peak = RC_PLAN_PEAK;
+    if (c->rc_max_rate > 0 && c->bit_rate > 0)
+        peak = (double)c->rc_max_rate / c->bit_rate;
+
+    double fps = av_q2d(Options.frame_rate);
+    float last = 1.0;
+
+    for (int i = 0; i < rc_plan_seconds; i++) {
+        double share = rc_plan[i] / mean;
+        float qf = 1.0;
+
+        if (share > peak)
+            qf = (float)FFMIN(share / peak, RC_PLAN_MAX_QF);
+        else
+        if (share < RC_PLAN_QUIET)
+            qf = RC_PLAN_QUIET_QF;
+
+        int start_frame = (int)(r->video_enc.pts_offset + i * fps);
+        int end_frame = (int)(r->video_enc.pts_offset + (i + 1) * fps) - 1;
+
+        // the seconds with the same factor make one override
+        if (c->rc_override_count > 0 && qf == last &&
+            c->rc_override[c->rc_override_count - 1].end_frame == start_frame - 1) {
+            c->rc_override[c->rc_override_count - 1].end_frame = end_frame;
+            continue;
         }
 
-        // initialize the resampling context
-        if (swr_init(audio_resample_ctx) < 0) {
-            fprintf(stderr, "Failed to initialize the resampling context\n");
-            exit(1);
+        last = qf;
+        if (qf == 1.0) continue;
+
+        c->rc_override = (RcOverride*)av_realloc(c->rc_override, (c->rc_override_count + 1) * sizeof(RcOverride));
+        if (!c->rc_override) {
+            c->rc_override_count = 0;
+            return;
         }
 
+        RcOverride *rco = &c->rc_override[c->rc_override_count++];
+        rco->start_frame = start_frame;
+        rco->end_frame = end_frame;
+        rco->qscale = 0;
+        rco->quality_factor = qf;
     }
 
+    fprintf(stderr, "Rate plan: %d overrides\n", c->rc_override_count);
+}
+
+// Name of the output file of a rendition: the first one writes 'avifile',
+// the others insert their frame size before the extension
+static char* get_rendition_filename(const char* avifile, int index)
+{
+    if (index == 0) return strdup(avifile);
+
+    char* filename = (char*)malloc(strlen(avifile) + 32);
+    const char* ext = strrchr(avifile, '.');
+    const char* slash = strrchr(avifile, '/');
+
+    if (ext == NULL || (slash && ext < slash)) ext = avifile + strlen(avifile);
+
+    sprintf(filename, "%.*s-%dx%d%s", (int)(ext - avifile), avifile,
+            renditions[index].width, renditions[index].height, ext);
+
+    return filename;
+}
+
+// Name of the output file in another format than the one of -f: the
+// extension is the one of the format
+static char* get_format_filename(const char* filename, AVOutputFormat *format)
+{
+    if (format == formats[0]) return strdup(filename);
+
+    char ext[32];
+    snprintf(ext, sizeof(ext), "%s", format->extensions && format->extensions[0] ? format->extensions : format->name);
+
+    char* p = strchr(ext, ',');
+    if (p) *p = 0;
+
+    const char* dot = strrchr(filename, '.');
+    const char* slash = strrchr(filename, '/');
+
+    if (dot == NULL || (slash && dot < slash)) dot = filename + strlen(filename);
+
+    char* name = (char*)malloc(strlen(filename) + strlen(ext) + 2);
+    sprintf(name, "%.*s.%s", (int)(dot - filename), filename, ext);
+
+    return name;
+}
+
+// The hls muxer writes the segments next to the playlist while encoding
+// and updates the playlist after each one, so the song can be played
+// before it's converted. The playlist keeps all the segments.
+static void set_segment_options(AVDictionary **opts, const char* filename)
+{
+    char value[1024 + 32];
+
+    snprintf(value, sizeof(value), "%g", Options.segment_time);
+    av_dict_set(opts, "hls_time", value, 0);
+    av_dict_set(opts, "hls_list_size", "0", 0);
+
+    // name of the playlist without the extension
+    const char* dot = strrchr(filename, '.');
+    const char* slash = strrchr(filename, '/');
+    int len = (dot && (!slash || dot > slash)) ? (int)(dot - filename) : (int)strlen(filename);
+
+    snprintf(value, sizeof(value), "%.*s-%%05d.ts", len, filename);
+    av_dict_set(opts, "hls_segment_filename", value, 0);
+}
+
+// Open the output file and write the header
+static void write_header(tOutput *out, const char* filename, AVFormatContext *ic)
+{
+    AVFormatContext *oc = out->oc;
+
     // open the output file, if needed
-    if (!(Options.format->flags & AVFMT_NOFILE)) {
-        if (avio_open(&oc->pb, avifile, AVIO_FLAG_WRITE) < 0) {
-            fprintf(stderr, "Could not open '%s'\n", avifile);
+    if (!(oc->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&oc->pb, filename, AVIO_FLAG_WRITE) < 0) {
+            fprintf(stderr, "Could not open '%s'\n", filename);
             exit(1);
         }
     }
 
     // Set context options
     oc->packet_size = Options.packet_size;
-    oc->max_delay = (int)(0.7 * AV_TIME_BASE);
+    oc->max_delay = Options.live ? 0 : (int)(0.7 * AV_TIME_BASE);
 
     // add meta data to the output file
     av_dict_set(&oc->metadata, "encoded_by", PACKAGE " " VERSION, 0);
@@ -910,187 +1723,1515 @@ int cdg2avi(const char* avifile, CdgIoStream* pAudioStream)
         if (tag) av_dict_set(&oc->metadata, tag->key, tag->value, 0);
     }
 
+    AVDictionary *opts = NULL;
+    if (strcmp(oc->oformat->name, "hls") == 0)
+        set_segment_options(&opts, filename);
+
     // write the stream header, if any
-    avformat_write_header(oc, NULL);
+    if (avformat_write_header(oc, &opts) < 0) {
+        fprintf(stderr, "Could not write the header of '%s'\n", filename);
+        exit(1);
+    }
 
-    // write avi file
-    int duration = cdgfile.getTotalDuration(); // in miliseconds
-    int64_t video_pts = 1000 * video_st->pts.val * video_st->time_base.num / video_st->time_base.den;;
+    // the options left are the ones this muxer version doesn't have
+    AVDictionaryEntry *unused = NULL;
+    while ((unused = av_dict_get(opts, "", unused, AV_DICT_IGNORE_SUFFIX)) != NULL)
+        fprintf(stderr, "WARNING: The %s muxer has no '%s' option\n", oc->oformat->name, unused->key);
 
-    while (cdgfile.renderAtPosition(video_pts))
-    {
-        write_video_frame(oc, video_st);
-        video_pts = 1000 * video_st->pts.val * video_st->time_base.num / video_st->time_base.den;;
+    av_dict_free(&opts);
+}
 
-        if (audio_st) {
-            int audio_ok = 0;
-            int64_t audio_pts;
-            do {
+// The muxers writing the AVChapters, the others (mpeg, vcd, dvd, mpegts,
+// avi...) drop them
+static bool format_has_chapters(AVOutputFormat *format)
+{
+    static const char *names[] = { "matroska", "webm", "mov", "mp4", "ipod", "ismv", "3gp", "3g2", NULL };
 
-                if (copy_audio) {
-                    audio_ok = copy_audio_frame(ic, in_audio_st, oc, audio_st);
-                }
-                else {
-                    audio_ok = write_audio_frame(ic, in_audio_st, oc, audio_st);
-                }
+    for (int i = 0; names[i] != NULL; i++) {
+        if (strstr(format->name, names[i])) return true;
+    }
 
-                audio_pts = 1000 * audio_st->pts.val * audio_st->time_base.num / audio_st->time_base.den;
+    return false;
+}
 
-            } while (audio_ok == 0 && audio_pts < video_pts);
-        }
+// Write the chapter starts of an output that can't hold them in
+// <output>.chapters, as a comma separated list of h:mm:ss.xxx times.
+// It goes as it is in the chapters attribute of a dvdauthor <vob>.
+static void write_chapter_list(AVFormatContext *oc)
+{
+    if (oc->nb_chapters == 0 || format_has_chapters(oc->oformat)) return;
 
-        if (duration) 
-        {
-            fprintf(stderr, "Progress: %d %%\r", (int)((video_pts * 100) / duration));
-        }
+    if (strcmp(oc->filename, "/dev/stdout") == 0) {
+        fprintf(stderr, "WARNING: The %s format can't hold the chapters, they are lost\n", oc->oformat->name);
+        return;
     }
-    fprintf(stderr, "\n"); // save the status line
+
+    char *listfile = (char*)malloc(strlen(oc->filename) + 16);
+    sprintf(listfile, "%s.chapters", oc->filename);
+
+    FILE *f = fopen(listfile, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open '%s'\n", listfile);
+        free(listfile);
+        return;
+    }
+
+    for (unsigned int i = 0; i < oc->nb_chapters; i++) {
+        int64_t ms = av_rescale_q(oc->chapters[i]->start, oc->chapters[i]->time_base, av_make_q(1, 1000));
+
+        fprintf(f, "%s%d:%02d:%02d.%03d", i ? "," : "", (int)(ms / 3600000), (int)(ms / 60000 % 60),
+                (int)(ms / 1000 % 60), (int)(ms % 1000));
+    }
+
+    fprintf(f, "\n");
+    if (fclose(f) != 0)
+        fprintf(stderr, "Could not write '%s'\n", listfile);
+    else
+        fprintf(stderr, "Chapters: the %s format can't hold them, written in %s\n", oc->oformat->name, listfile);
+
+    free(listfile);
+}
+
+// Write the trailer and close the output file
+static void close_output(tOutput *out, bool copy_audio)
+{
+    AVFormatContext *oc = out->oc;
 
     // close each codec
-    if (video_st)
-        close_video(oc, video_st);
+    if (out->video_st)
+        close_video(out->video_st);
 
-    if (copy_audio == false && audio_st)
-        close_audio(oc, audio_st);
+    if (copy_audio == false && out->audio_st)
+        close_audio(out->audio_st);
+
+    if (out->video_bsf)
+        av_bitstream_filter_close(out->video_bsf);
 
     // write the trailer, if any
     av_write_trailer(oc);
+    write_chapter_list(oc);
 
-    // free the streams
+    // free the streams and the chapters
     for(unsigned int i = 0; i < oc->nb_streams; i++) {
         av_freep(&oc->streams[i]->codec);
         av_freep(&oc->streams[i]);
     }
 
-    if (!(Options.format->flags & AVFMT_NOFILE)) {
+    for(unsigned int i = 0; i < oc->nb_chapters; i++) {
+        av_dict_free(&oc->chapters[i]->metadata);
+        av_freep(&oc->chapters[i]);
+    }
+    av_freep(&oc->chapters);
+
+    if (!(oc->oformat->flags & AVFMT_NOFILE)) {
         // close the output file
 	   avio_close(oc->pb);
     }
 
-    if (audio_resample_ctx)
-        swr_free(&audio_resample_ctx);
-
     // free the stream
     av_free(oc);
 
-    close_input_audio(ic, in_audio_st);
-    return 0;
+    memset(out, 0, sizeof(tOutput));
 }
 
-static void set_audio_codec_defaults()
+// Set up an output file of the rendition: the streams take the parameters
+// of the encoders, which are opened with the first output
+static void add_output(tRendition *r, int index, const char* filename,
+                       AVStream *in_audio_st, bool has_audio, bool copy_audio)
 {
-    if (!Options.format) return ;
+    tOutput *out = &r->outputs[index];
 
-    switch(Options.format->audio_codec)
-    {
-    case AV_CODEC_ID_AMR_NB:
-        Options.audio_bit_rate      = 12200;
-        Options.audio_sample_rate   = 8000;
-        Options.audio_channels      = 1;
-        break;
-    case AV_CODEC_ID_AMR_WB:
-        Options.audio_bit_rate      = 23850;
-        Options.audio_sample_rate   = 16000;
-        Options.audio_channels      = 1;
-        break;
+    // allocate the output media context
+    out->oc = avformat_alloc_context();
+    if (!out->oc) {
+        fprintf(stderr, "Memory error\n");
+        exit(1);
+    } 
 
-    //case AV_CODEC_ID_AC3:
-    //    Options.audio_bit_rate      = 192000;
-    //    Options.audio_sample_rate   = 48000;
-    //    Options.audio_channels      = 2;
-    //    break;
+    out->oc->oformat = formats[index];
+    snprintf(out->oc->filename, sizeof(out->oc->filename), "%s", filename);
 
-    default:
-        break;
+    if (Options.format->video_codec != AV_CODEC_ID_NONE) {
+        out->video_st = add_video_stream(out->oc, Options.format->video_codec, r);
+    }
+
+    if (has_audio) {
+        if (copy_audio) {
+            out->audio_st = add_audio_stream(out->oc, in_audio_st);
+        }
+        else {
+            out->audio_st = add_audio_stream(out->oc, Options.format->audio_codec);
+        }
+    }
+
+    if (index > 0) {
+        // the same encoders write in this file
+        if (out->video_st && avcodec_copy_context(out->video_st->codec, r->video_enc.ctx) < 0) {
+            fprintf(stderr, "Could not copy the video codec parameters\n");
+            exit(1);
+        }
+
+        if (out->audio_st && !copy_audio && avcodec_copy_context(out->audio_st->codec, audio_enc.ctx) < 0) {
+            fprintf(stderr, "Could not copy the audio codec parameters\n");
+            exit(1);
+        }
+    }
+
+    // a format without global headers (MPEG-TS) gets them before the key frames
+    if (out->video_st && want_global_header() && !(formats[index]->flags & AVFMT_GLOBALHEADER)) {
+        out->video_bsf = av_bitstream_filter_init("dump_extra");
+        if (!out->video_bsf) {
+            fprintf(stderr, "Could not find the dump_extra bitstream filter\n");
+            exit(1);
+        }
     }
+
+    av_dump_format(out->oc, 0, filename, 1);
 }
 
-static void set_video_codec_defaults()
+// Time base of the frame numbers: the one of the video encoder, or the
+// frame rate if nothing is encoded
+static AVRational frame_time_base()
 {
+    if (renditions[0].video_enc.ctx)
+        return renditions[0].video_enc.ctx->time_base;
+
+    return av_make_q(Options.frame_rate.den, Options.frame_rate.num);
 }
 
-static void set_format_defaults(const char* format)
+// Playlist mode: the first song opens the outputs and the encoders, the
+// next ones go on in the same streams, numbering their frames after the
+// ones already played (see close_playlist)
+static bool playlist_open;
+static int64_t playlist_frames;
+
+// Chapters of an offline playlist, one per song. The muxers writing them
+// with the header get the times planned from the size of the CDG streams,
+// the ones writing them with the trailer get the times the songs started.
+typedef struct {
+    char*   title;
+    int64_t start;      // in miliseconds
+    int64_t end;
+} tChapter;
+
+static tChapter *chapters;
+static int chapter_count;
+static int playlist_songs;      // songs started so far
+
+// Duration of the CDG stream of a song, from the size of the file, of the
+// zip entry or of the unpacked zstd file. -1 if it can't be opened.
+static long probe_duration(const char* filename)
 {
-    set_audio_codec_defaults();
-    set_video_codec_defaults();
+    CdgIoStream* pStream = NULL;
+    CdgFileIoStream filestream;
+    CdgZipFileIoStream zipstream;
+    struct zip* zipfile = NULL;
+    long duration = -1;
 
-    if (strcmp(format, "vcd")  == 0) 
-    {
-        Options.video_bit_rate      = 1150000;
-        Options.video_max_rate      = 1150000;
-        Options.video_min_rate      = 1150000;
-        Options.video_buffer_size   = 327680; // 40*1024*8;
-        Options.audio_bit_rate      = 224000;
-        Options.audio_sample_rate   = 44100;
-        Options.audio_channels      = 2;
+    const char* p = strrchr(filename, '.');
 
-        Options.packet_size         = 2324;
-        Options.mux_preload         = (36000+3*1200) / 90000.0; //0.44
-    }
-    else
-    if (strcmp(format, "svcd") == 0)    
+    if (p && strcasecmp(p+1, "zip") == 0)
     {
-        Options.video_bit_rate      = 2040000;
-        Options.video_max_rate      = 2516000;
-        Options.video_min_rate      = 0;
-        Options.video_buffer_size   = 1835008; // 224*1024*8;
+        int error;
+        zipfile = zip_open(filename, 0, &error);
 
-        Options.audio_bit_rate      = 224000;
-        Options.audio_sample_rate   = 44100;
-        Options.audio_channels      = 2;
-        Options.packet_size         = 2324;
+        for (int i = 0; zipfile && pStream == NULL; i++)
+        {
+            const char* name = zip_get_name(zipfile, i, 0);
+            if (name == NULL) break;
+
+            const char* ext = strrchr(name, '.');
+            if (ext && strcasecmp(ext+1, "cdg") == 0 && zipstream.open(zipfile, name))
+                pStream = &zipstream;
+        }
     }
     else
-    if ((strcmp(format, "dvd") == 0) ||
-        (strcmp(format, "vob") == 0))
+    if (strcmp(filename, "-") != 0 && filestream.open(filename, "r"))
     {
-        Options.video_bit_rate      = 6000000;
-        Options.video_max_rate      = 9000000;
-        Options.video_min_rate      = 0;
-        Options.video_buffer_size   = 1835008; // 224*1024*8;
-        Options.audio_bit_rate      = 224000;
-        Options.audio_sample_rate   = 44100;
-        Options.audio_channels      = 2;
-        Options.packet_size         = 2048;
+        pStream = &filestream;
     }
+
+#ifdef HAVE_ZSTD
+    CdgZstdIoStream zststream;
+
+    if (pStream && is_zstd_cdg(filename))
+        pStream = zststream.open(pStream) ? &zststream : NULL;
+#else
+    if (is_zstd_cdg(filename))
+        pStream = NULL;
+#endif
+
+    if (pStream)
+        duration = CDGFile::getStreamDuration(pStream);
+
+    zipstream.close();
+    if (zipfile) zip_close(zipfile);
+
+    return duration;
 }
 
-static struct option long_options[] =
+// One chapter per song that can be opened, named after the file
+static void plan_chapters(const tLibrary* songs)
 {
-    {"help",                no_argument,        0, 'h'},
-    {"show-formats",        no_argument,        0, OPTIONID_SHOW_FORMATS},
-    {"show-codecs",         no_argument,        0, OPTIONID_SHOW_CODECS}, 
-    {"version",             no_argument,        0, 'V'},
-    
-    {"format",              required_argument,  0, 'f'},
-    {"force-encode-audio",  no_argument,        0, OPTIONID_FORCE_ENCODE_AUDIO},
-    {"acodec",              required_argument,  0, OPTIONID_ACODEC},
-    {"vcodec",              required_argument,  0, OPTIONID_VCODEC},
-    {"aspect",              required_argument,  0, OPTIONID_ASPECT},
-    
-    {"stdout",              no_argument,        0, OPTIONID_STDOUT},
-    
-    {0, 0, 0, 0}
-};
+    int64_t start = 0;
 
-int main(int argc, char *argv[])
-{
-    int c, option_index = 0;
+    for (int i = 0; i < songs->count; i++)
+    {
+        const char* filename = songs->entries[i].cdgfile;
+        long duration = probe_duration(filename);
 
-    // initialize libavcodec, and register all codecs and formats
-    av_register_all();
+        if (duration < 0) continue;
 
-    // set default output format - xvid avi with mp3 audio
-    Options.format = av_guess_format("avi", NULL, NULL);
-    if (Options.format) {
-        //if (avcodec_find_encoder(AV_CODEC_ID_XVID)) 
-        //    Options.format->video_codec = AV_CODEC_ID_XVID;
-        if (avcodec_find_encoder(AV_CODEC_ID_MP3))  
-            Options.format->audio_codec = AV_CODEC_ID_MP3;
+        const char* name = strrchr(filename, '/');
+        name = name ? name + 1 : filename;
+
+        char* title = strdup(name);
+        if (is_zstd_cdg(title)) title[strlen(title) - 4] = 0;
+
+        char* ext = strrchr(title, '.');
+        if (ext && ext != title) *ext = 0;
+
+        chapters = (tChapter*)realloc(chapters, (chapter_count + 1) * sizeof(tChapter));
+        chapters[chapter_count].title = title;
+        chapters[chapter_count].start = start;
+        chapters[chapter_count].end = start + duration;
+        chapter_count++;
+
+        start += duration;
     }
+}
 
-    // parse command line options
-    while ((c = getopt_long(argc, argv, "hVs:r:f:", long_options, &option_index)) != -1) 
+static void add_chapters(AVFormatContext *oc)
+{
+    for (int i = 0; i < chapter_count; i++)
+    {
+        AVChapter *ch = (AVChapter*)av_mallocz(sizeof(AVChapter));
+        if (!ch) {
+            fprintf(stderr, "Memory error\n");
+            exit(1);
+        }
+
+        ch->id = i;
+        ch->time_base = av_make_q(1, 1000);
+        ch->start = chapters[i].start;
+        ch->end = chapters[i].end;
+        av_dict_set(&ch->metadata, "title", chapters[i].title, 0);
+
+        oc->chapters = (AVChapter**)av_realloc_f(oc->chapters, oc->nb_chapters + 1, sizeof(AVChapter*));
+        oc->chapters[oc->nb_chapters++] = ch;
+    }
+}
+
+// A song of the playlist starts at 'ms' in the output, the previous one
+// ends there
+static void set_chapter_start(int index, int64_t ms)
+{
+    if (index > chapter_count) return;
+
+    for (int i = 0; i < rendition_count; i++) {
+        for (int j = 0; j < format_count; j++) {
+            AVFormatContext *oc = renditions[i].outputs[j].oc;
+
+            if (index < (int)oc->nb_chapters)
+                oc->chapters[index]->start = ms;
+            if (index > 0 && index <= (int)oc->nb_chapters)
+                oc->chapters[index - 1]->end = ms;
+        }
+    }
+}
+
+static void free_chapters()
+{
+    for (int i = 0; i < chapter_count; i++)
+        free(chapters[i].title);
+
+    free(chapters);
+    chapters = NULL;
+    chapter_count = 0;
+}
+
+// Open the output files of every rendition in every format, with their
+// encoders, and write the headers
+static void open_outputs(const char* avifile, AVFormatContext *ic, AVStream *in_audio_st,
+                         bool has_audio, bool copy_audio)
+{
+    char* filenames[MAX_RENDITIONS][MAX_FORMATS];
+
+    // the first output of the first rendition opens the audio encoder
+    for (int i = 0; i < rendition_count; i++) {
+        tRendition *r = &renditions[i];
+        char* filename = get_rendition_filename(avifile, i);
+
+        for (int j = 0; j < format_count; j++) {
+            tOutput *out = &r->outputs[j];
+            filenames[i][j] = get_format_filename(filename, formats[j]);
+
+            add_output(r, j, filenames[i][j], in_audio_st, has_audio, copy_audio);
+            add_chapters(out->oc);
+
+            if (j == 0 && out->video_st)
+                open_video(r, out->video_st);
+
+            if (j == 0 && out->video_st && Options.rc_plan)
+                apply_rc_plan(r);
+
+            if (i == 0 && j == 0 && out->audio_st && !copy_audio)
+                open_audio(out->oc, out->audio_st);
+        }
+
+        free(filename);
+    }
+
+    AVStream *audio_st = renditions[0].outputs[0].audio_st;
+
+    if (copy_audio == false && audio_st) {
+        // the other renditions mux the packets of the same encoder
+        for (int i = 1; i < rendition_count; i++) {
+            if (avcodec_copy_context(renditions[i].outputs[0].audio_st->codec, audio_enc.ctx) < 0) {
+                fprintf(stderr, "Could not copy the audio codec parameters\n");
+                exit(1);
+            }
+        }
+    }
+
+    for (int i = 0; i < rendition_count; i++) {
+        for (int j = 0; j < format_count; j++) {
+            write_header(&renditions[i].outputs[j], filenames[i][j], ic);
+            free(filenames[i][j]);
+        }
+    }
+
+    for (int i = 0; i < rendition_count; i++)
+        memset(&renditions[i].video_stats, 0, sizeof(tEncodeStats));
+}
+
+// Flush the video encoders, print their statistics and close the output
+// files
+static void close_outputs(bool copy_audio)
+{
+    for (int i = 0; i < rendition_count; i++) {
+        tRendition *r = &renditions[i];
+
+        if (r->outputs[0].video_st)
+            flush_video(r);
+
+        if (r->video_stats.frames)
+            fprintf(stderr, "Video encoding (%s, %dx%d): %d frames in %.1f s, %.2f ms per frame\n",
+                    r->video_enc.ctx->codec->name, r->video_enc.ctx->width, r->video_enc.ctx->height,
+                    r->video_stats.frames, r->video_stats.time / 1000000.0,
+                    r->video_stats.time / 1000.0 / r->video_stats.frames);
+    }
+
+    for (int i = 0; i < rendition_count; i++) {
+        for (int j = 0; j < format_count; j++)
+            close_output(&renditions[i].outputs[j], copy_audio);
+    }
+
+    if (Options.live)
+        report_live_latency();
+}
+
+// The encoders and the output files, for the frames...
+class EncoderSink : public FrameSink
+{
+public:
+    // The audio input of the song opening the output
+    void setInput(AVFormatContext *ic, AVStream *in_audio_st, bool has_audio, bool copy_audio)
+    {
+        m_ic = ic;
+        m_in_audio_st = in_audio_st;
+        m_has_audio = has_audio;
+        m_copy_audio = copy_audio;
+    }
+
+    virtual bool open(const char* filename)
+    {
+        open_outputs(filename, m_ic, m_in_audio_st, m_has_audio, m_copy_audio);
+        return true;
+    }
+
+    virtual void close()
+    {
+        close_outputs(m_copy_audio);
+    }
+
+    virtual void writeFrame(const tSinkFrame* frame)
+    {
+        for (int i = 0; i < rendition_count; i++)
+            write_video_frame(&renditions[i], frame->pts, frame->key);
+    }
+
+    // with --mb-align the renditions scale the surface themselves
+    virtual bool wantsRgb24()
+    {
+        for (int i = 0; i < rendition_count; i++) {
+            if (!renditions[i].scale_x) return true;
+        }
+        return false;
+    }
+
+protected:
+    AVFormatContext *m_ic;
+    AVStream *m_in_audio_st;
+    bool m_has_audio;
+    bool m_copy_audio;
+};
+
+// ...and for the audio, opened by the frame sink
+class EncoderAudioSink : public AudioSink
+{
+public:
+    virtual bool open(const AVCodecContext* format) { return true; }
+    virtual void close() {}
+
+    // the encoding errors are reported, the conversion goes on
+    virtual bool writeAudio(const AVFrame* samples)
+    {
+        int data_written;
+        encode_audio_frame((AVFrame*)samples, &data_written);
+        return true;
+    }
+};
+
+// Local readers of the rendered frames (--shm)
+class ShmSink : public FrameSink
+{
+public:
+    // The ring is created once per run, a reader attached during the first
+    // song sees the next ones in the same mapping
+    virtual bool open(const char* filename)
+    {
+        if (m_ring.isOpen()) return true;
+
+        return m_ring.create(Options.shm_name, CDG_FULL_WIDTH, CDG_FULL_HEIGHT,
+                             CDG_TILE_COLUMNS, CDG_TILE_ROWS, SHM_RING_SLOTS);
+    }
+
+    virtual void close()
+    {
+        // a job forked by --watch or --daemon is a run of its own
+        if (Options.watch || Options.daemon_socket) m_ring.close();
+    }
+
+    // End of the run, the ring is removed
+    void release()
+    {
+        m_ring.close();
+    }
+
+    // The frame and the tiles changed since the previous one are copied in
+    // the next slot of the ring
+    virtual void writeFrame(const tSinkFrame* frame)
+    {
+        uint8_t *damage;
+        uint32_t *pixels = m_ring.beginFrame(&damage);
+
+        for (int y = 0; y < CDG_FULL_HEIGHT; y++) {
+            uint32_t *line = (uint32_t*)((uint8_t*)pixels + y * m_ring.getStride());
+
+            for (int x = 0; x < CDG_FULL_WIDTH; x++)
+                line[x] = (uint32_t)frame->rgb32[y][x];
+        }
+
+        for (int row = 0; row < CDG_TILE_ROWS; row++) {
+            for (int column = 0; column < CDG_TILE_COLUMNS; column++)
+                damage[row * CDG_TILE_COLUMNS + column] = frame->cdg->isTileChanged(row, column);
+        }
+
+        m_ring.publishFrame(frame->ms, frame->cdg->getChangedTiles());
+    }
+
+protected:
+    ShmRing m_ring;
+};
+
+// Uncompressed frames in the YUV4MPEG2 format (--raw-video), at the size
+// and in the pixel format of -s and -pix_fmt. The frame is scaled straight
+// in the buffer of the writer.
+class Y4mSink : public FrameSink
+{
+public:
+    Y4mSink() : m_convert_ctx(NULL) {}
+
+    virtual bool open(const char* filename)
+    {
+        const char *chroma;
+        int chroma_w, chroma_h;
+
+        switch (Options.frame_pix_fmt) {
+        case PIX_FMT_YUV420P: chroma = "420jpeg"; chroma_w = 2; chroma_h = 2; break;
+        case PIX_FMT_YUV422P: chroma = "422"; chroma_w = 2; chroma_h = 1; break;
+        case PIX_FMT_YUV444P: chroma = "444"; chroma_w = 1; chroma_h = 1; break;
+        default:
+            fprintf(stderr, "The raw video needs a 4:2:0, 4:2:2 or 4:4:4 planar YUV picture\n");
+            return false;
+        }
+
+        m_convert_ctx = sws_getCachedContext(m_convert_ctx,
+                                             CDG_FULL_WIDTH, CDG_FULL_HEIGHT, PIX_FMT_RGB24,
+                                             Options.width, Options.height, Options.frame_pix_fmt,
+                                             SWS_BICUBIC, NULL, NULL, NULL);
+        if (m_convert_ctx == NULL) {
+            fprintf(stderr, "Cannot initialize the conversion context\n");
+            return false;
+        }
+
+        AVRational sar = av_d2q(av_q2d(Options.aspect_ratio) * Options.height / Options.width, 255);
+
+        return m_writer.open(Options.raw_video, Options.width, Options.height,
+                             Options.frame_rate.num, Options.frame_rate.den,
+                             sar.num, sar.den, chroma, chroma_w, chroma_h);
+    }
+
+    virtual void close()
+    {
+        m_writer.close();
+
+        sws_freeContext(m_convert_ctx);
+        m_convert_ctx = NULL;
+    }
+
+    virtual void writeFrame(const tSinkFrame* frame)
+    {
+        uint8_t *data[4];
+        int linesize[4];
+
+        m_writer.beginFrame(data, linesize);
+        sws_scale(m_convert_ctx, frame->rgb24->data, frame->rgb24->linesize,
+                  0, CDG_FULL_HEIGHT, data, linesize);
+
+        if (!m_writer.writeFrame()) {
+            fprintf(stderr, "Could not write the raw video frame\n");
+            exit(1);
+        }
+    }
+
+    virtual bool wantsRgb24() { return true; }
+
+protected:
+    Y4mWriter m_writer;
+    struct SwsContext *m_convert_ctx;
+};
+
+// Uncompressed audio (--raw-audio), converted from the encoder input, or
+// from the decoded input when the audio is copied, to 16 bit samples
+class WavSink : public AudioSink
+{
+public:
+    WavSink() : m_convert_ctx(NULL) {}
+
+    virtual bool open(const AVCodecContext* c)
+    {
+        // the input decoder may leave the layout unset
+        int64_t layout = c->channel_layout ? c->channel_layout : av_get_default_channel_layout(c->channels);
+
+        m_convert_ctx = swr_alloc_set_opts(m_convert_ctx,
+                                           layout, AV_SAMPLE_FMT_S16, c->sample_rate,
+                                           layout, c->sample_fmt, c->sample_rate,
+                                           0, NULL);
+
+        if (!m_convert_ctx || swr_init(m_convert_ctx) < 0) {
+            fprintf(stderr, "Failed to initialize the raw audio conversion\n");
+            return false;
+        }
+
+        m_channels = c->channels;
+        return m_writer.open(Options.raw_audio, c->sample_rate, c->channels);
+    }
+
+    virtual void close()
+    {
+        m_writer.close();
+        swr_free(&m_convert_ctx);
+    }
+
+    virtual bool writeAudio(const AVFrame* frame)
+    {
+        int16_t *samples = (int16_t*)av_malloc(frame->nb_samples * m_channels * sizeof(int16_t));
+        if (!samples) {
+            fprintf(stderr, "Memory error\n");
+            return false;
+        }
+
+        bool ok = swr_convert(m_convert_ctx, (uint8_t**)&samples, frame->nb_samples,
+                              (const uint8_t**)frame->extended_data, frame->nb_samples) == frame->nb_samples &&
+                  m_writer.write(samples, frame->nb_samples);
+
+        if (!ok)
+            fprintf(stderr, "Could not write the raw audio samples\n");
+
+        av_free(samples);
+        return ok;
+    }
+
+protected:
+    WavWriter m_writer;
+    SwrContext *m_convert_ctx;
+    int m_channels;
+};
+
+// Rendering only (--null): the frames are counted, the speed is reported
+// at the end
+class NullSink : public FrameSink
+{
+public:
+    virtual bool open(const char* filename)
+    {
+        m_frames = 0;
+        m_start = jobpool_time();
+        return true;
+    }
+
+    virtual void close()
+    {
+        int64_t time = jobpool_time() - m_start;
+        double seconds = (double)m_frames * Options.frame_rate.den / Options.frame_rate.num;
+
+        if (m_frames && time > 0)
+            fprintf(stderr, "Rendering: %d frames in %.3f s, %.0f fps, %.1fx realtime\n",
+                    m_frames, time / 1000000.0, m_frames * 1000000.0 / time, seconds * 1000000.0 / time);
+    }
+
+    virtual void writeFrame(const tSinkFrame* frame)
+    {
+        m_frames++;
+    }
+
+protected:
+    int     m_frames;
+    int64_t m_start;
+};
+
+// MD5 of every rendered frame (--frame-hash), in the framemd5 layout, to
+// check that a change of the decoder is bit exact. The pixels are hashed as
+// 0x00RRGGBB in little endian, whatever the size of the surface values.
+class HashSink : public FrameSink
+{
+public:
+    HashSink() : m_file(NULL), m_md5(NULL) {}
+
+    // The file is opened once per run, the frames of every song follow
+    // their output name in a comment line
+    virtual bool open(const char* filename)
+    {
+        if (m_file) {
+            fprintf(m_file, "#output: %s\n", filename);
+            return true;
+        }
+
+        m_file = strcmp(Options.frame_hash, "-") == 0 ? stdout : fopen(Options.frame_hash, "w");
+        if (m_file == NULL) {
+            fprintf(stderr, "Could not open '%s'\n", Options.frame_hash);
+            return false;
+        }
+
+        if (!m_md5 && !(m_md5 = av_md5_alloc())) {
+            fprintf(stderr, "Memory error\n");
+            return false;
+        }
+
+        fprintf(m_file, "#format: frame checksums\n");
+        fprintf(m_file, "#hash: MD5\n");
+        fprintf(m_file, "#tb 0: %d/%d\n", Options.frame_rate.den, Options.frame_rate.num);
+        fprintf(m_file, "#stream#, dts, pts, duration, size, hash\n");
+        fprintf(m_file, "#output: %s\n", filename);
+        return true;
+    }
+
+    virtual void close()
+    {
+        if (m_file) fflush(m_file);
+    }
+
+    // End of the run
+    void release()
+    {
+        if (m_file && m_file != stdout)
+            fclose(m_file);
+        else if (m_file)
+            fflush(m_file);
+
+        m_file = NULL;
+        av_freep(&m_md5);
+    }
+
+    virtual void writeFrame(const tSinkFrame* frame)
+    {
+        uint8_t line[CDG_FULL_WIDTH * 4];
+        uint8_t sum[16];
+
+        av_md5_init(m_md5);
+
+        for (int y = 0; y < CDG_FULL_HEIGHT; y++) {
+            for (int x = 0; x < CDG_FULL_WIDTH; x++) {
+                line[x * 4]     = (uint8_t)(frame->rgb32[y][x]);
+                line[x * 4 + 1] = (uint8_t)(frame->rgb32[y][x] >> 8);
+                line[x * 4 + 2] = (uint8_t)(frame->rgb32[y][x] >> 16);
+                line[x * 4 + 3] = 0;
+            }
+
+            av_md5_update(m_md5, line, sizeof(line));
+        }
+
+        av_md5_final(m_md5, sum);
+
+        fprintf(m_file, "0, %10lld, %10lld, 1, %8d, ", (long long)frame->pts, (long long)frame->pts,
+                (int)sizeof(line) * CDG_FULL_HEIGHT);
+        for (int i = 0; i < 16; i++)
+            fprintf(m_file, "%02x", sum[i]);
+        fprintf(m_file, "\n");
+    }
+
+protected:
+    FILE *m_file;
+    struct AVMD5 *m_md5;
+};
+
+static EncoderSink encoder_sink;
+static EncoderAudioSink encoder_audio_sink;
+static NullSink null_sink;
+static HashSink hash_sink;
+static ShmSink shm_sink;
+static Y4mSink y4m_sink;
+static WavSink wav_sink;
+static bool sinks_want_rgb24;
+
+// The encoders come first, unless nothing is encoded, then the other sinks
+// as given by the options
+static void add_sinks()
+{
+    if (Options.null_sink) {
+        frame_sinks[frame_sink_count++] = &null_sink;
+    }
+    else {
+        frame_sinks[frame_sink_count++] = &encoder_sink;
+        audio_sinks[audio_sink_count++] = &encoder_audio_sink;
+    }
+
+    if (Options.frame_hash)
+        frame_sinks[frame_sink_count++] = &hash_sink;
+
+    if (Options.shm_name)
+        frame_sinks[frame_sink_count++] = &shm_sink;
+
+    if (Options.raw_video)
+        frame_sinks[frame_sink_count++] = &y4m_sink;
+
+    if (Options.raw_audio)
+        audio_sinks[audio_sink_count++] = &wav_sink;
+}
+
+// Open the frame sinks, then the audio sinks with the format of the audio
+// encoder, or of the input audio when it's copied
+static void open_sinks(const char* filename, bool copy_audio, AVStream *in_audio_st)
+{
+    sinks_want_rgb24 = false;
+
+    for (int i = 0; i < frame_sink_count; i++) {
+        if (!frame_sinks[i]->open(filename))
+            exit(1);
+
+        if (frame_sinks[i]->wantsRgb24())
+            sinks_want_rgb24 = true;
+    }
+
+    if (sinks_want_rgb24 && !rgb_picture &&
+        !(rgb_picture = alloc_picture(PIX_FMT_RGB24, CDG_FULL_WIDTH, CDG_FULL_HEIGHT))) {
+        fprintf(stderr, "Could not allocate temporary picture\n");
+        exit(1);
+    }
+
+    // a copied audio goes to the sinks after the encoder, decoded
+    audio_sinks_from = copy_audio ? 1 : 0;
+    audio_sinks_open = renditions[0].outputs[0].audio_st && audio_sink_count > audio_sinks_from;
+
+    const AVCodecContext *format = copy_audio ? in_audio_st->codec : audio_enc.ctx;
+
+    for (int i = audio_sinks_from; i < audio_sink_count && audio_sinks_open; i++) {
+        if (!audio_sinks[i]->open(format))
+            exit(1);
+    }
+
+    live_start = jobpool_time();
+}
+
+static void close_sinks()
+{
+    for (int i = 0; i < frame_sink_count; i++)
+        frame_sinks[i]->close();
+
+    for (int i = audio_sinks_from; i < audio_sink_count && audio_sinks_open; i++)
+        audio_sinks[i]->close();
+
+    audio_sinks_open = false;
+}
+
+// Hand the rendered frame to the sinks, 'pts' is the frame number in the
+// output
+static void write_sink_frame(int64_t pts, bool key, AVRational time_base)
+{
+    tSinkFrame frame;
+
+    frame.pts = pts;
+    frame.ms = 1000 * pts * time_base.num / time_base.den;
+    frame.key = key;
+    frame.cdg = &cdgfile;
+    frame.rgb32 = frameSurface.rgbData;
+    frame.rgb24 = sinks_want_rgb24 ? rgb_picture : NULL;
+
+    if (sinks_want_rgb24)
+        copy_cdg_frame();
+
+    for (int i = 0; i < frame_sink_count; i++)
+        frame_sinks[i]->writeFrame(&frame);
+}
+
+// End of the playlist: the audio encoder is drained, the outputs closed
+static void close_playlist()
+{
+    if (!playlist_open) return;
+
+    if (renditions[0].outputs[0].audio_st)
+        flush_audio();
+
+    // the last song ends with the output
+    AVRational time_base = frame_time_base();
+    set_chapter_start(playlist_songs, 1000 * playlist_frames * time_base.num / time_base.den);
+
+    close_sinks();
+    free_chapters();
+
+    playlist_open = false;
+    playlist_frames = 0;
+    playlist_songs = 0;
+}
+
+int cdg2avi(const char* avifile, CdgIoStream* pAudioStream)
+{
+    AVFormatContext *ic = NULL;
+    AVStream *in_audio_st = NULL;
+    bool copy_audio = false;
+    bool has_audio = false;
+
+    if ((rendition_count > 1 || format_count > 1) && strcmp(avifile, "/dev/stdout") == 0) {
+        fprintf(stderr, "Can't write several output files to the standard output\n");
+        return -1;
+    }
+
+    if (pAudioStream) {
+        in_audio_st = open_input_audio(pAudioStream, &ic);
+        if (in_audio_st == NULL) {
+            if (ic == NULL)
+                fprintf(stderr, "WARNING: Unable to allocate context for audio file: %s\n", pAudioStream->getfilename());
+            else
+                fprintf(stderr, "WARNING: Unable to find input audio stream in %s\n", pAudioStream->getfilename());
+        }
+    }
+
+    // clip: the CDG packets up to the start are processed without
+    // rendering, and the audio is seeked to it. The output starts at zero.
+    int64_t clip_start = Options.clip_start;
+    int64_t clip_end = Options.clip_duration ? clip_start + Options.clip_duration : 0;
+
+    audio_clip_ts = AV_NOPTS_VALUE;
+
+    if (clip_start && !cdgfile.advanceTo(clip_start)) {
+        fprintf(stderr, "The song is shorter than the start point\n");
+        close_input_audio(ic, in_audio_st);
+        return -1;
+    }
+
+    if (clip_start && in_audio_st)
+        seek_input_audio(ic, in_audio_st, clip_start);
+
+    if (Options.playlist)
+    {
+        // the songs come in any audio format, and the ones without audio
+        // get silence
+        has_audio = Options.format->audio_codec != AV_CODEC_ID_NONE;
+    }
+    else
+    if (in_audio_st && Options.format->audio_codec != AV_CODEC_ID_NONE) 
+    {
+        has_audio = true;
+
+        if (Options.format->audio_codec == in_audio_st->codec->codec_id) {
+            copy_audio = true;
+        }
+        
+        if (Options.audio_encode_always) {
+            copy_audio = false; 
+        }
+    }
+
+    // the next song of a playlist goes on in the open outputs
+    // the tags of the first song don't describe a playlist
+    if (!playlist_open) {
+        encoder_sink.setInput(Options.playlist ? NULL : ic, in_audio_st, has_audio, copy_audio);
+        open_sinks(avifile, copy_audio, in_audio_st);
+        playlist_open = Options.playlist;
+    }
+
+    AVStream *audio_st = renditions[0].outputs[0].audio_st;
+
+    if (copy_audio == false && audio_st && in_audio_st) {
+        // Set up the resampler for the input file, the context is reused
+        audio_resample_ctx = swr_alloc_set_opts(audio_resample_ctx, 
+                                    audio_st->codec->channel_layout,    
+                                    audio_st->codec->sample_fmt,    
+                                    audio_st->codec->sample_rate,
+                                    in_audio_st->codec->channel_layout, 
+                                    in_audio_st->codec->sample_fmt, 
+                                    in_audio_st->codec->sample_rate,
+                                    0, NULL);
+
+        if (!audio_resample_ctx) {
+            fprintf(stderr, "Can't resample audio.  Aborting.\n");
+            exit(1);
+        }
+
+        // initialize the resampling context
+        if (swr_init(audio_resample_ctx) < 0) {
+            fprintf(stderr, "Failed to initialize the resampling context\n");
+            exit(1);
+        }
+
+    }
+
+    // write avi file
+    int duration = cdgfile.getTotalDuration(); // in miliseconds
+    AVRational time_base = frame_time_base();
+
+    // clip: the progress is shown for the window only
+    if (clip_end && (duration == 0 || duration > clip_end))
+        duration = clip_end;
+    if (duration)
+        duration -= clip_start;
+
+    // frames are numbered in the codec time base, in vfr mode the unchanged
+    // ones are skipped, up to max_gap frames in a row. In a playlist they
+    // are written after the ones of the previous songs.
+    int64_t frame = 0, last_frame = -1, frames_written = 0, scene_cuts = 0;
+    int64_t first_frame = playlist_frames;
+
+    if (Options.playlist)
+        set_chapter_start(playlist_songs++, 1000 * first_frame * time_base.num / time_base.den);
+
+    int64_t max_gap = (int64_t)(Options.max_frame_gap * time_base.den / time_base.num);
+    int64_t video_pts = clip_start; // in the song...
+    int64_t output_pts = 0;     // ...and in the output, in miliseconds
+
+    // the hls segments start with a key frame forced every segment_time
+    int64_t segment_frames = 0;
+    for (int i = 0; i < format_count; i++) {
+        if (strcmp(formats[i]->name, "hls") == 0)
+            segment_frames = FFMAX(1, (int64_t)(Options.segment_time * time_base.den / time_base.num));
+    }
+
+    while ((clip_end == 0 || video_pts < clip_end) && cdgfile.renderAtPosition(video_pts))
+    {
+        // a batch job waits here while an interactive one has its CPU
+        jobpool_check_pause();
+
+        bool cut = Options.scene_gop && cdgfile.isSceneCut();
+        bool segment = segment_frames && (first_frame + frame) % segment_frames == 0;
+
+        if (!Options.vfr || cdgfile.isChanged() || segment || frame - last_frame >= max_gap) {
+            write_sink_frame(first_frame + frame, cut || segment, time_base);
+
+            last_frame = frame;
+            frames_written++;
+            if (cut) scene_cuts++;
+        }
+
+        frame++;
+        video_pts = clip_start + 1000 * frame * time_base.num / time_base.den;
+        output_pts = 1000 * (first_frame + frame) * time_base.num / time_base.den;
+
+        if (audio_st) {
+            int audio_ok = 0;
+            int64_t audio_pts;
+            do {
+
+                if (copy_audio) {
+                    audio_ok = copy_audio_frame(ic, in_audio_st);
+                }
+                else {
+                    audio_ok = write_audio_frame(ic, in_audio_st);
+                }
+
+                audio_pts = 1000 * audio_st->pts.val * audio_st->time_base.num / audio_st->time_base.den;
+
+            } while (audio_ok == 0 && audio_pts < output_pts);
+
+            if (Options.playlist && audio_ok != 0)
+                pad_audio(audio_st, output_pts);
+        }
+
+        // live: wait until the next frame is due
+        if (Options.live) {
+            int64_t delay = live_start + output_pts * 1000 - jobpool_time();
+
+            // the end of a playlist song is sent ahead, to cover the opening
+            // of the next one
+            long song_duration = cdgfile.getTotalDuration();
+            if (Options.playlist && song_duration && video_pts > song_duration - PLAYLIST_LEAD)
+                delay -= PLAYLIST_LEAD * 1000;
+
+            if (delay > 0) usleep(delay);
+        }
+
+        if (duration) 
+        {
+            fprintf(stderr, "Progress: %d %%\r", (int)(((video_pts - clip_start) * 100) / duration));
+        }
+        else
+        {
+            // reading from a pipe, the duration is not known
+            fprintf(stderr, "Position: %d:%02d\r", (int)(video_pts / 60000), (int)(video_pts / 1000) % 60);
+        }
+    }
+    fprintf(stderr, "\n"); // save the status line
+
+    // the last frame holds the screen until the end
+    if (Options.vfr && last_frame >= 0 && last_frame < frame - 1) {
+        write_sink_frame(first_frame + frame - 1, false, time_base);
+        frames_written++;
+    }
+
+    if (Options.vfr)
+        fprintf(stderr, "Frames: %d of %d written\n", (int)frames_written, (int)frame);
+
+    if (Options.scene_gop)
+        fprintf(stderr, "Scene cuts: %d key frames forced\n", (int)scene_cuts);
+
+    // the audio goes on after the clip, its encoder wasn't flushed at the end
+    if (clip_end && audio_st && !copy_audio && !audio_enc.flushed)
+        flush_audio();
+
+    if (Options.playlist)
+        playlist_frames = first_frame + frame;
+    else
+        close_sinks();
+
+    close_input_audio(ic, in_audio_st);
+    return 0;
+}
+
+static void set_audio_codec_defaults()
+{
+    if (!Options.format) return ;
+
+    switch(Options.format->audio_codec)
+    {
+    case AV_CODEC_ID_AMR_NB:
+        Options.audio_bit_rate      = 12200;
+        Options.audio_sample_rate   = 8000;
+        Options.audio_channels      = 1;
+        break;
+    case AV_CODEC_ID_AMR_WB:
+        Options.audio_bit_rate      = 23850;
+        Options.audio_sample_rate   = 16000;
+        Options.audio_channels      = 1;
+        break;
+
+    //case AV_CODEC_ID_AC3:
+    //    Options.audio_bit_rate      = 192000;
+    //    Options.audio_sample_rate   = 48000;
+    //    Options.audio_channels      = 2;
+    //    break;
+
+    default:
+        break;
+    }
+}
+
+static void set_video_codec_defaults()
+{
+}
+
+static void set_format_defaults(const char* format)
+{
+    set_audio_codec_defaults();
+    set_video_codec_defaults();
+
+    if (strcmp(format, "vcd")  == 0) 
+    {
+        Options.video_bit_rate      = 1150000;
+        Options.video_max_rate      = 1150000;
+        Options.video_min_rate      = 1150000;
+        Options.video_buffer_size   = 327680; // 40*1024*8;
+        Options.audio_bit_rate      = 224000;
+        Options.audio_sample_rate   = 44100;
+        Options.audio_channels      = 2;
+
+        Options.packet_size         = 2324;
+        Options.mux_preload         = (36000+3*1200) / 90000.0; //0.44
+    }
+    else
+    if (strcmp(format, "svcd") == 0)    
+    {
+        Options.video_bit_rate      = 2040000;
+        Options.video_max_rate      = 2516000;
+        Options.video_min_rate      = 0;
+        Options.video_buffer_size   = 1835008; // 224*1024*8;
+
+        Options.audio_bit_rate      = 224000;
+        Options.audio_sample_rate   = 44100;
+        Options.audio_channels      = 2;
+        Options.packet_size         = 2324;
+    }
+    else
+    if ((strcmp(format, "dvd") == 0) ||
+        (strcmp(format, "vob") == 0))
+    {
+        Options.video_bit_rate      = 6000000;
+        Options.video_max_rate      = 9000000;
+        Options.video_min_rate      = 0;
+        Options.video_buffer_size   = 1835008; // 224*1024*8;
+        Options.audio_bit_rate      = 224000;
+        Options.audio_sample_rate   = 44100;
+        Options.audio_channels      = 2;
+        Options.packet_size         = 2048;
+    }
+}
+
+// Generate the output file name from the input file name
+static char* get_output_filename(const char* filename)
+{
+    char* avifile = (char*)malloc(strlen(filename) + 64);
+    char* p;
+
+    if (Options.output_file)
+    {
+        free(avifile);
+        return strdup(Options.output_file);
+    }
+
+    strcpy(avifile, filename);
+    if (is_zstd_cdg(avifile)) avifile[strlen(avifile) - 4] = 0;     // *.cdg.zst
+
+    p = strrchr(avifile, '.'); p++;
+
+    // the output of a stream read from the standard input goes to the standard output
+    if (Options.video_stdout || strcmp(filename, "-") == 0)
+    {
+        strcpy(avifile, "/dev/stdout");
+    }
+    else
+    if (Options.format->extensions == NULL) {
+        strcpy(p, "mpg");
+    }
+    else
+    if (Options.format->extensions[0] == 0) {
+        p--; *p = 0;
+    }
+    else {
+        strcpy(p, Options.format->extensions);
+        p = strchr(p, ',');
+        if (p) *p = 0;
+    }
+
+    return avifile;
+}
+
+// Name of the thumbnails of the file, -o or the input file without the extension
+static char* get_thumbnail_basename(const char* filename)
+{
+    char* basename = strdup(Options.output_file ? Options.output_file : filename);
+    if (is_zstd_cdg(basename)) basename[strlen(basename) - 4] = 0;     // *.cdg.zst
+
+    char* p = strrchr(basename, '.');
+    if (p && strchr(p, '/') == NULL) *p = 0;
+
+    return basename;
+}
+
+// Convert a single CDG or zip file, "-" reads the CDG stream from the
+// standard input. If the audio file is not given,
+// it's searched next to the CDG file (or inside the zip archive).
+// If the inputs were already read in memory by the prefetcher, they are
+// passed in 'staged' and the files are not opened again.
+// Return:
+//  0 - if the file was converted
+// -1 - if the file can't be opened
+static int convert_file(const char* filename, const char* audiofile, tStagedJob* staged)
+{
+    bool extcdg = false;
+    bool extzip = false;
+    bool extzst = false;
+    int res = -1;
+    
+    const char* p = strrchr(filename, '.');
+    
+    if (strcmp(filename, "-") == 0) extcdg = true;
+    else
+    if (is_zstd_cdg(filename)) extzst = true;
+    else
+    if (p && strcasecmp(p+1, "cdg") == 0) extcdg = true;
+    else
+    if (p && strcasecmp(p+1, "zip") == 0) extzip = true;
+        
+    if (extcdg == false && extzip == false && extzst == false)
+    {
+        fprintf(stderr, "File is ignored (unsupported file type) : %s\n", filename);
+        return -1;
+    }
+
+#ifndef HAVE_ZSTD
+    if (extzst)
+    {
+        fprintf(stderr, "File is ignored (compiled without zstd support) : %s\n", filename);
+        return -1;
+    }
+#endif
+
+    // name of the CDG file without the .zst extension, used to find the audio file
+    char* cdgname = strdup(filename);
+    if (extzst) cdgname[strlen(cdgname) - 4] = 0;
+    
+    CdgIoStream* pCdgStream = NULL;
+    CdgIoStream* pAudioStream = NULL;
+
+    CdgFileIoStream cdgfilestream;
+    CdgFileIoStream audiofilestream;
+    CdgZipFileIoStream cdgzipstream;
+    CdgZipFileIoStream audiozipstream;
+    CdgMemIoStream cdgmemstream;
+    CdgMemIoStream audiomemstream;
+    
+    if (staged)
+    {
+        if (cdgmemstream.open(staged->cdg.data, staged->cdg.size, filename))
+            pCdgStream = &cdgmemstream;
+
+        if (audiomemstream.open(staged->audio.data, staged->audio.size, staged->audio.name))
+            pAudioStream = &audiomemstream;
+    }
+    else
+    if ((extcdg || extzst) && cdgfilestream.open(filename, "r"))
+    {
+        pCdgStream = &cdgfilestream;
+    }
+
+#ifdef HAVE_ZSTD
+    CdgZstdIoStream cdgzststream;
+
+    if (extzst && pCdgStream)
+    {
+        if (cdgzststream.open(pCdgStream)) 
+        {
+            pCdgStream = &cdgzststream;
+        }
+        else 
+        {
+            fprintf(stderr, "Not a seekable zstd file: %s\n", filename);
+            pCdgStream = NULL;
+        }
+    }
+#endif
+    
+    struct zip* zipfile = NULL;
+    if (extzip && staged == NULL)
+    {
+        int error;
+        zipfile = zip_open(filename, 0, &error);
+        if (zipfile) 
+        {
+            // find cdg file
+            int cdgidx = 0; 
+            const char* name = NULL;
+            
+            do 
+            {
+                name = zip_get_name(zipfile, cdgidx++, 0);
+                if (name) 
+                {
+                    const char* p = strrchr(name, '.');
+                    if (p) 
+                    {
+                        if (pCdgStream == NULL && strcasecmp(p+1, "cdg") == 0 && 
+                            cdgzipstream.open(zipfile, name)) 
+                        {
+                            pCdgStream = &cdgzipstream;
+                        }
+                        else
+                        if (pAudioStream == NULL && is_supported_audio(p+1) &&
+                            audiozipstream.open(zipfile, name))
+                        {
+                            pAudioStream = &audiozipstream;
+                        }
+                    }
+                }
+            } while (name && (pCdgStream == NULL || pAudioStream == NULL));
+            
+        }
+        else 
+        {
+            fprintf(stderr, "Zip error %d on file: %s\n", error, filename);
+        }
+    }
+    
+    bool opened = pCdgStream && cdgfile.open(pCdgStream, &frameSurface);
+
+    if (opened && Options.thumbnails.times)
+    {
+        // no audio and no video, only the picked frames are rendered
+        char* basename = get_thumbnail_basename(filename);
+        res = thumbnails_extract(&cdgfile, &frameSurface, basename, &Options.thumbnails);
+        free(basename);
+    }
+    else
+    if (opened && !Options.thumbnails.times && (!Options.rc_plan || analyse_cdg(pCdgStream)))
+    {
+        fprintf(stderr, "Converting: %s\n", filename);
+
+        // find corresponding audio file
+        char* foundfile = NULL;
+        
+        if (pAudioStream == NULL && audiofile == NULL && strcmp(filename, "-") != 0) {
+            audiofile = foundfile = get_audio_filename(cdgname);
+        }
+
+        if (pAudioStream == NULL) {
+            if (audiofile != NULL && audiofilestream.open(audiofile, "r")) {
+                pAudioStream = &audiofilestream;
+            }
+            else {
+                fprintf(stderr, "WARNING: Can't find audio file (*.mp3)\n");
+            }
+        }
+
+        // generate avi file name
+        char* avifile = get_output_filename(filename);
+
+        // perform actual conversion
+        res = cdg2avi(avifile, pAudioStream);
+
+        // free allocated memory
+        free(avifile);
+        if (foundfile) free(foundfile);
+    }
+    else 
+    {
+        fprintf(stderr, "Unable to open file: %s\n", filename);
+    }
+    
+    cdgzipstream.close();
+    audiozipstream.close();
+    if (zipfile) zip_close(zipfile);
+    free(cdgname);
+
+    return res;
+}
+
+// Conversion of a pair found by the watch folder mode
+static int convert_pair(const char* cdgfile, const char* audiofile)
+{
+    return convert_file(cdgfile, audiofile, NULL);
+}
+
+// Conversion of a daemon request, in the forked job process
+static int convert_request(const char* cdgfile, const char* audiofile, const char* outputfile)
+{
+    Options.output_file = outputfile;
+    return convert_file(cdgfile, audiofile, NULL);
+}
+
+#ifdef HAVE_ZSTD
+// Pack the CDG files in the seekable zstd format, next to the original files
+static void pack_files(const tLibrary* files)
+{
+    for (int i = 0; i < files->count; i++) 
+    {
+        const char* cdgfile = files->entries[i].cdgfile;
+        const char* p = strrchr(cdgfile, '.');
+
+        if (p == NULL || strcasecmp(p+1, "cdg") != 0) 
+        {
+            fprintf(stderr, "File is ignored (not a CDG file) : %s\n", cdgfile);
+            continue;
+        }
+
+        char* zstfile = (char*)malloc(strlen(cdgfile) + 5);
+        sprintf(zstfile, "%s.zst", cdgfile);
+        cdgio_pack_zstd(cdgfile, zstfile, Options.zstd_level);
+        free(zstfile);
+    }
+}
+#endif
+
+static struct option long_options[] =
+{
+    {"help",                no_argument,        0, 'h'},
+    {"show-formats",        no_argument,        0, OPTIONID_SHOW_FORMATS},
+    {"show-codecs",         no_argument,        0, OPTIONID_SHOW_CODECS}, 
+    {"version",             no_argument,        0, 'V'},
+    
+    {"format",              required_argument,  0, 'f'},
+    {"force-encode-audio",  no_argument,        0, OPTIONID_FORCE_ENCODE_AUDIO},
+    {"acodec",              required_argument,  0, OPTIONID_ACODEC},
+    {"vcodec",              required_argument,  0, OPTIONID_VCODEC},
+    {"aspect",              required_argument,  0, OPTIONID_ASPECT},
+    {"vfr",                 no_argument,        0, OPTIONID_VFR},
+    {"max-frame-gap",       required_argument,  0, OPTIONID_MAX_FRAME_GAP},
+    {"scene-gop",           optional_argument,  0, OPTIONID_SCENE_GOP},
+    {"mb-align",            no_argument,        0, OPTIONID_MB_ALIGN},
+    {"rc-plan",             no_argument,        0, OPTIONID_RC_PLAN},
+    {"rendition",           required_argument,  0, OPTIONID_RENDITION},
+    {"tee",                 required_argument,  0, OPTIONID_TEE},
+    {"segment-time",        required_argument,  0, OPTIONID_SEGMENT_TIME},
+    {"live",                no_argument,        0, OPTIONID_LIVE},
+    {"playlist",            no_argument,        0, OPTIONID_PLAYLIST},
+    {"shm",                 required_argument,  0, OPTIONID_SHM},
+    {"raw-video",           required_argument,  0, OPTIONID_RAW_VIDEO},
+    {"raw-audio",           required_argument,  0, OPTIONID_RAW_AUDIO},
+    {"null",                no_argument,        0, OPTIONID_NULL},
+    {"frame-hash",          required_argument,  0, OPTIONID_FRAME_HASH},
+    {"thumbnails",          required_argument,  0, OPTIONID_THUMBNAILS},
+    {"thumbnail-count",     required_argument,  0, OPTIONID_THUMBNAIL_COUNT},
+    {"thumbnail-format",    required_argument,  0, OPTIONID_THUMBNAIL_FORMAT},
+    {"contact-sheet",       optional_argument,  0, OPTIONID_CONTACT_SHEET},
+    {"start",               required_argument,  0, OPTIONID_START},
+    {"duration",            required_argument,  0, OPTIONID_DURATION},
+    
+    {"stdout",              no_argument,        0, OPTIONID_STDOUT},
+    {"output",              required_argument,  0, 'o'},
+    {"audio",               required_argument,  0, OPTIONID_AUDIO},
+    
+    {"recursive",           no_argument,        0, 'R'},
+    {"manifest",            required_argument,  0, OPTIONID_MANIFEST},
+    {"song-list",           required_argument,  0, OPTIONID_SONG_LIST},
+    {"prefetch",            required_argument,  0, OPTIONID_PREFETCH},
+    {"prefetch-budget",     required_argument,  0, OPTIONID_PREFETCH_BUDGET},
+    {"watch",               no_argument,        0, OPTIONID_WATCH},
+    {"jobs",                required_argument,  0, 'j'},
+    {"daemon",              required_argument,  0, OPTIONID_DAEMON},
+#ifdef HAVE_ZSTD
+    {"pack-zstd",           optional_argument,  0, OPTIONID_PACK_ZSTD},
+#endif
+    
+    {0, 0, 0, 0}
+};
+
+int main(int argc, char *argv[])
+{
+    int c, option_index = 0;
+
+    // initialize libavcodec, and register all codecs and formats
+    av_register_all();
+
+    // set default output format - xvid avi with mp3 audio
+    Options.format = av_guess_format("avi", NULL, NULL);
+    if (Options.format) {
+        //if (avcodec_find_encoder(AV_CODEC_ID_XVID)) 
+        //    Options.format->video_codec = AV_CODEC_ID_XVID;
+        if (avcodec_find_encoder(AV_CODEC_ID_MP3))  
+            Options.format->audio_codec = AV_CODEC_ID_MP3;
+    }
+
+    // parse command line options
+    while ((c = getopt_long(argc, argv, "hVRs:r:f:o:j:", long_options, &option_index)) != -1) 
     {
         switch (c) 
         {
@@ -1106,86 +3247,322 @@ int main(int argc, char *argv[])
             print_help("codecs");
             return 0;
 
-        case 'V':
-            print_version();
-            return 0;
+        case 'V':
+            print_version();
+            return 0;
+
+        case 's':
+            if (get_frame_size(&Options.width, &Options.height, optarg)) {
+                fprintf(stderr, "Incorrect frame size\n");
+                return 1;
+            }
+
+            if ((Options.width % 2) != 0 || (Options.height % 2) != 0) {
+                fprintf(stderr, "Frame size must be a multiple of 2\n");
+                return 1;
+            }
+            break;
+
+        case 'r':
+            if (get_frame_rate(&Options.frame_rate.num, &Options.frame_rate.den, optarg)) {
+                fprintf(stderr, "Incorrect frame rate\n");
+                return 1;
+            }
+            break;
+
+        case 'f':
+            Options.format = av_guess_format(optarg, NULL, NULL);
+
+            if (Options.format == NULL) {
+                fprintf(stderr, "Could not find suitable output format\n");
+                return 1;
+            }
+
+            set_format_defaults(optarg);
+            break;
+
+        case OPTIONID_FORCE_ENCODE_AUDIO:
+            Options.audio_encode_always = 1;
+            break;
+
+        case OPTIONID_ACODEC:
+            if (Options.format) {
+                AVCodec *p = avcodec_find_encoder_by_name(optarg);
+                if (p && p->type == AVMEDIA_TYPE_AUDIO) Options.format->audio_codec = p->id;
+                else {
+                    fprintf(stderr, "Could not find '%s' audio codec\n", optarg);
+                    return 1;
+                }
+                set_audio_codec_defaults();
+            }
+            break;
+
+        case OPTIONID_VCODEC:
+            if (Options.format) {
+                AVCodec *p = avcodec_find_encoder_by_name(optarg);
+                if (p && p->type == AVMEDIA_TYPE_VIDEO) Options.format->video_codec = p->id;
+                else {
+                    fprintf(stderr, "Could not find '%s' video codec\n", optarg);
+                    return 1;
+                }
+                set_video_codec_defaults();
+            }
+            break;
+
+        case OPTIONID_ASPECT:
+            if (get_aspect_ratio(&Options.aspect_ratio, optarg)) {
+                fprintf(stderr, "Incorrect aspect ratio\n");
+                return 1;
+            }
+            break;
+            
+        case OPTIONID_VFR:
+            Options.vfr = 1;
+            break;
+
+        case OPTIONID_MAX_FRAME_GAP:
+            Options.max_frame_gap = atof(optarg);
+            if (Options.max_frame_gap <= 0) {
+                fprintf(stderr, "Incorrect maximum frame gap\n");
+                return 1;
+            }
+            break;
+
+        case OPTIONID_SCENE_GOP:
+            Options.scene_gop = 1;
+            if (optarg) Options.max_gop = atof(optarg);
+            if (Options.max_gop <= 0) {
+                fprintf(stderr, "Incorrect GOP length\n");
+                return 1;
+            }
+            break;
+
+        case OPTIONID_MB_ALIGN:
+            Options.mb_align = 1;
+            break;
+
+        case OPTIONID_RC_PLAN:
+            Options.rc_plan = 1;
+            break;
+
+        case OPTIONID_RENDITION:
+        {
+            if (rendition_count == MAX_RENDITIONS) {
+                fprintf(stderr, "Too many renditions (max. %d)\n", MAX_RENDITIONS - 1);
+                return 1;
+            }
 
-        case 's':
-            if (get_frame_size(&Options.width, &Options.height, optarg)) {
-                fprintf(stderr, "Incorrect frame size\n");
+            // <size>[:<bit rate in kbit/s>]
+            char size[64];
+            snprintf(size, sizeof(size), "%s", optarg);
+
+            char *rate = strchr(size, ':');
+            if (rate) *rate++ = 0;
+
+            tRendition *r = &renditions[rendition_count];
+
+            if (get_frame_size(&r->width, &r->height, size) || (rate && atoi(rate) <= 0)) {
+                fprintf(stderr, "Incorrect rendition: %s\n", optarg);
                 return 1;
             }
 
-            if ((Options.width % 2) != 0 || (Options.height % 2) != 0) {
+            if ((r->width % 2) != 0 || (r->height % 2) != 0) {
                 fprintf(stderr, "Frame size must be a multiple of 2\n");
                 return 1;
             }
+
+            r->video_bit_rate = rate ? atoi(rate) * 1000 : 0;
+            rendition_count++;
             break;
+        }
 
-        case 'r':
-            if (get_frame_rate(&Options.frame_rate.num, &Options.frame_rate.den, optarg)) {
-                fprintf(stderr, "Incorrect frame rate\n");
+        case OPTIONID_TEE:
+            if (format_count == MAX_FORMATS) {
+                fprintf(stderr, "Too many output formats (max. %d)\n", MAX_FORMATS);
+                return 1;
+            }
+
+            formats[format_count] = av_guess_format(optarg, NULL, NULL);
+
+            if (formats[format_count] == NULL) {
+                fprintf(stderr, "Could not find output format: %s\n", optarg);
                 return 1;
             }
+
+            format_count++;
             break;
 
-        case 'f':
-            Options.format = av_guess_format(optarg, NULL, NULL);
+        case OPTIONID_SEGMENT_TIME:
+            Options.segment_time = atof(optarg);
 
-            if (Options.format == NULL) {
-                fprintf(stderr, "Could not find suitable output format\n");
+            if (Options.segment_time <= 0) {
+                fprintf(stderr, "Incorrect segment time\n");
                 return 1;
             }
+            break;
 
-            set_format_defaults(optarg);
+        case OPTIONID_LIVE:
+            Options.live = 1;
             break;
 
-        case OPTIONID_FORCE_ENCODE_AUDIO:
-            Options.audio_encode_always = 1;
+        case OPTIONID_PLAYLIST:
+            Options.playlist = 1;
             break;
 
-        case OPTIONID_ACODEC:
-            if (Options.format) {
-                AVCodec *p = avcodec_find_encoder_by_name(optarg);
-                if (p && p->type == AVMEDIA_TYPE_AUDIO) Options.format->audio_codec = p->id;
-                else {
-                    fprintf(stderr, "Could not find '%s' audio codec\n", optarg);
-                    return 1;
-                }
-                set_audio_codec_defaults();
+        case OPTIONID_SHM:
+            Options.shm_name = optarg;
+            break;
+
+        case OPTIONID_RAW_VIDEO:
+            Options.raw_video = optarg;
+            break;
+
+        case OPTIONID_RAW_AUDIO:
+            Options.raw_audio = optarg;
+            break;
+
+        case OPTIONID_NULL:
+            Options.null_sink = 1;
+            break;
+
+        case OPTIONID_FRAME_HASH:
+            Options.frame_hash = optarg;
+            break;
+
+        case OPTIONID_THUMBNAILS:
+        {
+            long times[THUMBNAIL_MAX];
+            if (thumbnails_parse(optarg, times, THUMBNAIL_MAX) < 0) {
+                fprintf(stderr, "Incorrect thumbnail times (max. %d): %s\n", THUMBNAIL_MAX, optarg);
+                return 1;
             }
+            Options.thumbnails.times = optarg;
             break;
+        }
 
-        case OPTIONID_VCODEC:
-            if (Options.format) {
-                AVCodec *p = avcodec_find_encoder_by_name(optarg);
-                if (p && p->type == AVMEDIA_TYPE_VIDEO) Options.format->video_codec = p->id;
-                else {
-                    fprintf(stderr, "Could not find '%s' video codec\n", optarg);
-                    return 1;
-                }
-                set_video_codec_defaults();
+        case OPTIONID_THUMBNAIL_COUNT:
+            Options.thumbnails.count = atoi(optarg);
+            if (Options.thumbnails.count <= 0 || Options.thumbnails.count > THUMBNAIL_MAX) {
+                fprintf(stderr, "Incorrect number of thumbnails (max. %d)\n", THUMBNAIL_MAX);
+                return 1;
             }
             break;
 
-        case OPTIONID_ASPECT:
-            if (get_aspect_ratio(&Options.aspect_ratio, optarg)) {
-                fprintf(stderr, "Incorrect aspect ratio\n");
+        case OPTIONID_THUMBNAIL_FORMAT:
+            if (strcmp(optarg, "png") != 0 && strcmp(optarg, "webp") != 0) {
+                fprintf(stderr, "Incorrect thumbnail format (png or webp): %s\n", optarg);
                 return 1;
             }
+            Options.thumbnails.format = optarg;
             break;
-            
+
+        case OPTIONID_START:
+        case OPTIONID_DURATION:
+        {
+            // [[hh:]mm:]ss[.xxx], as in ffmpeg -ss and -t
+            int64_t us;
+            if (av_parse_time(&us, optarg, 1) < 0 || us < 0 || (c == OPTIONID_DURATION && us == 0)) {
+                fprintf(stderr, "Incorrect time: %s\n", optarg);
+                return 1;
+            }
+
+            if (c == OPTIONID_START)
+                Options.clip_start = us / 1000;
+            else
+                Options.clip_duration = us / 1000;
+            break;
+        }
+
+        case OPTIONID_CONTACT_SHEET:
+            Options.thumbnails.sheet_columns = optarg ? atoi(optarg) : 4;
+            if (Options.thumbnails.sheet_columns <= 0) {
+                fprintf(stderr, "Incorrect number of contact sheet columns\n");
+                return 1;
+            }
+            break;
+
         case OPTIONID_STDOUT:
             Options.video_stdout = 1;
             break;
 
+        case 'o':
+            Options.output_file = optarg;
+            break;
+
+        case OPTIONID_AUDIO:
+            Options.audio_file = optarg;
+            break;
+
+        case 'R':
+            Options.recursive = 1;
+            break;
+
+        case OPTIONID_MANIFEST:
+            Options.manifest = optarg;
+            break;
+
+        case OPTIONID_SONG_LIST:
+            Options.song_list = optarg;
+            Options.playlist = 1;
+            break;
+
+        case OPTIONID_PREFETCH:
+            Options.prefetch_depth = atoi(optarg);
+            if (Options.prefetch_depth < 0) {
+                fprintf(stderr, "Incorrect prefetch depth\n");
+                return 1;
+            }
+            break;
+
+        case OPTIONID_WATCH:
+            Options.watch = 1;
+            break;
+
+        case OPTIONID_DAEMON:
+            Options.daemon_socket = optarg;
+            break;
+
+        case 'j':
+            Options.jobs = atoi(optarg);
+            if (Options.jobs <= 0) {
+                fprintf(stderr, "Incorrect number of jobs\n");
+                return 1;
+            }
+            break;
+
+        case OPTIONID_PACK_ZSTD:
+            Options.pack_zstd = 1;
+            if (optarg) Options.zstd_level = atoi(optarg);
+#ifdef HAVE_ZSTD
+            {
+#if ZSTD_VERSION_NUMBER >= 10400
+                int min_level = ZSTD_minCLevel();
+#else
+                int min_level = 1;
+#endif
+                if (Options.zstd_level < min_level || Options.zstd_level > ZSTD_maxCLevel()) {
+                    fprintf(stderr, "Incorrect zstd level (%d to %d)\n", min_level, ZSTD_maxCLevel());
+                    return 1;
+                }
+            }
+#endif
+            break;
+
+        case OPTIONID_PREFETCH_BUDGET:
+            Options.prefetch_budget = (int64_t)atoi(optarg) << 20;
+            if (Options.prefetch_budget <= 0) {
+                fprintf(stderr, "Incorrect prefetch budget\n");
+                return 1;
+            }
+            break;
+
         default:
             print_usage();
             return 1;
         }
     }
 
-    if (argc <= optind) {
+    if (argc <= optind && !Options.daemon_socket && !Options.song_list) {
         printf("%s: missing CDGFILE\n", PACKAGE);
         print_usage();
         return -1;
@@ -1203,132 +3580,301 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    formats[0] = Options.format;
+
+    for (int i = 0; i < format_count; i++) {
+        // the other containers assume a constant frame rate
+        if (Options.vfr && !strstr(formats[i]->name, "matroska") &&
+            !strstr(formats[i]->name, "mp4") && !strstr(formats[i]->name, "mov")) {
+            fprintf(stderr, "--vfr needs a matroska, mp4 or mov output format\n");
+            return 1;
+        }
+
+        // the codecs of -f are written in every format
+        if (avformat_query_codec(formats[i], Options.format->video_codec, FF_COMPLIANCE_NORMAL) == 0 ||
+            avformat_query_codec(formats[i], Options.format->audio_codec, FF_COMPLIANCE_NORMAL) == 0) {
+            fprintf(stderr, "The %s format can't hold the codecs of the %s format\n",
+                    formats[i]->name, Options.format->name);
+            return 1;
+        }
+
+        for (int j = 0; j < i; j++) {
+            if (formats[j] == formats[i]) {
+                fprintf(stderr, "The %s format is given twice\n", formats[i]->name);
+                return 1;
+            }
+        }
+    }
+
+    // the disc formats have a fixed frame size
+    if (Options.mb_align && want_disc_stream()) {
+        fprintf(stderr, "--mb-align can't be used with the vcd, svcd and dvd formats\n");
+        return 1;
+    }
+
+    if (format_count > 1 && Options.video_stdout) {
+        fprintf(stderr, "--tee can't be used with --stdout\n");
+        return 1;
+    }
+
+    // a contact sheet of the automatically picked frames by default
+    if (Options.thumbnails.sheet_columns && !Options.thumbnails.times) {
+        Options.thumbnails.times = "auto";
+    }
+
+    // the thumbnails are written next to the input files, one set per song
+    if (Options.thumbnails.times && (Options.video_stdout || Options.playlist)) {
+        fprintf(stderr, "--thumbnails can't be used with --stdout or --playlist\n");
+        return 1;
+    }
+
+    // the WAV samples come from the audio encoder
+    if (Options.null_sink && Options.raw_audio) {
+        fprintf(stderr, "--raw-audio can't be used with --null\n");
+        return 1;
+    }
+
+    // a Y4M stream has a constant frame rate
+    if (Options.raw_video && Options.vfr) {
+        fprintf(stderr, "--raw-video can't be used with --vfr\n");
+        return 1;
+    }
+
+    // a single output can go to the standard output
+    if ((Options.raw_video && strcmp(Options.raw_video, "-") == 0) +
+        (Options.raw_audio && strcmp(Options.raw_audio, "-") == 0) +
+        (Options.frame_hash && strcmp(Options.frame_hash, "-") == 0) + (Options.video_stdout != 0) > 1) {
+        fprintf(stderr, "Only one output can be written to the standard output\n");
+        return 1;
+    }
+
+    // a clip is cut from one song, the plan is made for all its frames
+    if ((Options.clip_start || Options.clip_duration) && (Options.playlist || Options.rc_plan)) {
+        fprintf(stderr, "--start and --duration can't be used with --playlist or --rc-plan\n");
+        return 1;
+    }
+
+    // the plan numbers the frames of the file, vfr skips some of them
+    if (Options.rc_plan && Options.vfr) {
+        fprintf(stderr, "--rc-plan can't be used with --vfr\n");
+        return 1;
+    }
+
+    // the first rendition is the one of -s and the format, the others get
+    // the bit rate of the format in proportion to the frame size
+    renditions[0].width = Options.width;
+    renditions[0].height = Options.height;
+    renditions[0].video_bit_rate = Options.video_bit_rate;
+
+    for (int i = 1; i < rendition_count; i++) {
+        tRendition *r = &renditions[i];
+
+        if (r->video_bit_rate == 0)
+            r->video_bit_rate = (int)((int64_t)Options.video_bit_rate * r->width * r->height /
+                                      (Options.width * Options.height));
+    }
+
+    if (rendition_count > 1 && Options.video_stdout) {
+        fprintf(stderr, "--rendition can't be used with --stdout\n");
+        return 1;
+    }
+
+    // a playlist numbers its frames on from song to song, the plan is made
+    // for the frames of one file
+    if (Options.playlist && Options.rc_plan) {
+        fprintf(stderr, "--rc-plan can't be used with --playlist\n");
+        return 1;
+    }
+
+    if (Options.playlist && (Options.watch || Options.daemon_socket)) {
+        fprintf(stderr, "--playlist can't be used with --watch or --daemon\n");
+        return 1;
+    }
+
+    // a playlist reads the next song while the current one plays
+    if (Options.playlist && Options.prefetch_depth == 0) {
+        Options.prefetch_depth = 1;
+    }
+
+    if (Options.jobs == 0) {
+        Options.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    add_sinks();
+
+    // the jobs are forked, each one would write the file anew
+    if ((Options.raw_video || Options.raw_audio || Options.frame_hash) && (Options.watch || Options.daemon_socket)) {
+        fprintf(stderr, "--raw-video, --raw-audio and --frame-hash can't be used with --watch or --daemon\n");
+        return 1;
+    }
+
+    if (Options.daemon_socket) {
+        warm_up_profile();
+        return daemon_serve(Options.daemon_socket, Options.jobs, convert_request);
+    }
+
+    if (Options.watch) {
+        return watch_folders(argv + optind, argc - optind, Options.recursive, Options.jobs, convert_pair);
+    }
+
+    // collect the files to convert, scanning the directories if requested
+    tLibrary jobs, pending, previous, done;
+    library_init(&jobs);
+    library_init(&pending);
+    library_init(&previous);
+    library_init(&done);
+
     for (int files = optind; files < argc; files++) 
     {
-        bool extcdg = false;
-        bool extzip = false;
-        
-        char* p = strrchr(argv[files], '.');
-        
-        if (p && strcasecmp(p+1, "cdg") == 0) extcdg = true;
+        struct stat st;
+
+        if (stat(argv[files], &st) != 0) 
+        {
+            memset(&st, 0, sizeof(st));
+        }
         else
-        if (p && strcasecmp(p+1, "zip") == 0) extzip = true;
-            
-        if (extcdg == false && extzip == false)
+        if (S_ISDIR(st.st_mode))
         {
-            fprintf(stderr, "File is ignored (unsupported file type) : %s\n", argv[files]);
+            if (Options.recursive) 
+                library_scan(&jobs, argv[files]);
+            else
+                fprintf(stderr, "Directory is ignored (use --recursive) : %s\n", argv[files]);
             continue;
         }
-        
-        CdgIoStream* pCdgStream = NULL;
-        CdgIoStream* pAudioStream = NULL;
 
-        CdgFileIoStream cdgfilestream;
-        CdgFileIoStream audiofilestream;
-        CdgZipFileIoStream cdgzipstream;
-        CdgZipFileIoStream audiozipstream;
-        
-        if (extcdg && cdgfilestream.open(argv[files], "r"))
+        tLibraryEntry* e = library_add(&jobs, argv[files], Options.audio_file);
+        e->cdg_size = st.st_size;
+        e->cdg_mtime = st.st_mtime;
+
+        // a changed audio file is a change of the entry too, the one found
+        // next to the CDG file is the one convert_file will use
+        char* foundfile = NULL;
+        const char* audiofile = Options.audio_file;
+
+        if (audiofile == NULL && S_ISREG(st.st_mode))
         {
-            pCdgStream = &cdgfilestream;
+            char* cdgname = strdup(argv[files]);
+            if (is_zstd_cdg(cdgname)) cdgname[strlen(cdgname) - 4] = 0;
+            audiofile = foundfile = get_audio_filename(cdgname);
+            free(cdgname);
         }
-        
-        struct zip* zipfile = NULL;
-        if (extzip)
+
+        struct stat ast;
+        if (audiofile && stat(audiofile, &ast) == 0)
         {
-            int error;
-            zipfile = zip_open(argv[files], 0, &error);
-            if (zipfile) 
-            {
-                // find cdg file
-                int cdgidx = 0; 
-                const char* filename = NULL;
-                
-                do 
-                {
-                    filename = zip_get_name(zipfile, cdgidx++, 0);
-                    if (filename) 
-                    {
-                        const char* p = strrchr(filename, '.');
-                        if (p) 
-                        {
-                            if (pCdgStream == NULL && strcasecmp(p+1, "cdg") == 0 && 
-                                cdgzipstream.open(zipfile, filename)) 
-                            {
-                                pCdgStream = &cdgzipstream;
-                            }
-                            else
-                            if (pAudioStream == NULL && is_supported_audio(p+1) &&
-                                audiozipstream.open(zipfile, filename))
-                            {
-                                pAudioStream = &audiozipstream;
-                            }
-                        }
-                    }
-                } while (filename && (pCdgStream == NULL || pAudioStream == NULL));
-                
-            }
-            else 
-            {
-                fprintf(stderr, "Zip error %d on file: %s\n", error, argv[files]);
-            }
+            e->audio_size = ast.st_size;
+            e->audio_mtime = ast.st_mtime;
         }
-        
-        if (pCdgStream && cdgfile.open(pCdgStream, &frameSurface)) 
-        {
-            fprintf(stderr, "Converting: %s\n", argv[files]);
 
-            // find corresponding audio file
-            char* audiofile = get_audio_filename(argv[files]);
+        if (foundfile) free(foundfile);
+    }
 
-            if (pAudioStream == NULL) {
-                if (audiofile != NULL && audiofilestream.open(audiofile, "r")) {
-                    pAudioStream = &audiofilestream;
-                }
-                else {
-                    fprintf(stderr, "WARNING: Can't find audio file (*.mp3)\n");
-                }
-            }
+    if (Options.song_list && library_load_list(&jobs, Options.song_list) != 0) {
+        fprintf(stderr, "Unable to read the song list: %s\n", Options.song_list);
+        return 1;
+    }
 
-            // generate avi file name
-            char* avifile = (char*)malloc(strlen(argv[files]) + 64);
-            strcpy(avifile, argv[files]);
-            p = strrchr(avifile, '.'); p++;
+    if (((Options.output_file && !Options.playlist) || Options.audio_file) && jobs.count > 1) {
+        fprintf(stderr, "--output and --audio can be used with a single CDGFILE only\n");
+        return 1;
+    }
 
-            if (Options.video_stdout)
-            {
-                strcpy(avifile, "/dev/stdout");
-            }
-            else
-            if (Options.format->extensions == NULL) {
-                strcpy(p, "mpg");
-            }
-            else
-            if (Options.format->extensions[0] == 0) {
-                p--; *p = 0;
-            }
-            else {
-                strcpy(p, Options.format->extensions);
-                p = strchr(p, ',');
-                if (p) *p = 0;
-            }
+    // the raw outputs have one name, each song would overwrite the previous one
+    if ((Options.raw_video || Options.raw_audio) && !Options.playlist && jobs.count > 1) {
+        fprintf(stderr, "--raw-video and --raw-audio can be used with a single CDGFILE only, or with --playlist\n");
+        return 1;
+    }
+
+    if (Options.manifest) 
+    {
+        library_load_manifest(&previous, Options.manifest);
+        library_mark_unchanged(&jobs, &previous);
+    }
 
-            // perform actual conversion
-            cdg2avi(avifile, pAudioStream);
+    for (int i = 0; i < jobs.count; i++) 
+    {
+        tLibraryEntry* e = &jobs.entries[i];
 
-            // free allocated memory
+        // every song of a playlist is played again, and the standard output
+        // or -o are written anew on every run
+        if (e->unchanged && !Options.playlist && !Options.output_file)
+        {
+            // the output of an unchanged entry is reused, if it's still there
+            char* avifile = get_output_filename(e->cdgfile);
+            bool exists = strcmp(avifile, "/dev/stdout") != 0 && access(avifile, F_OK) == 0;
             free(avifile);
-            if (audiofile) free(audiofile);
+
+            if (exists) 
+            {
+                fprintf(stderr, "Skipping (unchanged): %s\n", e->cdgfile);
+                library_add_entry(&done, e);
+                continue;
+            }
         }
-        else 
+
+        library_add_entry(&pending, e);
+    }
+
+    // pack the CDG files instead of converting them
+    if (Options.pack_zstd)
+    {
+#ifdef HAVE_ZSTD
+        pack_files(&pending);
+#endif
+        library_free(&pending);
+    }
+
+    // the chapters are written with the header, before the songs are read
+    if (Options.playlist && !Options.live)
+    {
+        plan_chapters(&pending);
+    }
+
+    // read the inputs of the next jobs while the current one is encoding
+    Prefetcher prefetcher;
+    bool prefetch = Options.prefetch_depth > 0 && pending.count > 1 &&
+                    prefetcher.start(&pending, Options.prefetch_depth, Options.prefetch_budget);
+
+    for (int i = 0; i < pending.count; i++) 
+    {
+        tLibraryEntry* e = &pending.entries[i];
+        tStagedJob staged;
+        bool hit = prefetch && prefetcher.take(i, &staged);
+
+        if (convert_file(e->cdgfile, e->audiofile, hit ? &staged : NULL) == 0) 
         {
-            fprintf(stderr, "Unable to open file: %s\n", argv[files]);
+            library_add_entry(&done, e);
         }
-        
-        cdgzipstream.close();
-        audiozipstream.close();
-        if (zipfile) zip_close(zipfile);
+
+        if (hit) prefetcher.release(&staged);
+    }
+
+    if (Options.playlist)
+    {
+        close_playlist();
     }
 
+    if (prefetch) 
+    {
+        prefetcher.stop();
+        prefetcher.printStats();
+    }
+
+    shm_sink.release();
+    hash_sink.release();
+
+    if (Options.manifest) 
+    {
+        // the files of the earlier runs stay in the manifest
+        library_merge(&done, &previous, &jobs);
+        library_save_manifest(&done, Options.manifest);
+    }
+
+    library_free(&jobs);
+    library_free(&pending);
+    library_free(&previous);
+    library_free(&done);
+    close_profile();
+
     return 0;
 }
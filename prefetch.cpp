@@ -0,0 +1,413 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_CONSTANT_MACROS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <zip.h>
+
+#include "ffmpeg_headers.h"
+#include "prefetch.h"
+#include "utils.h"
+
+enum
+{
+    STAGE_NONE = 0,     // not staged yet
+    STAGE_LOADING,      // being read by the prefetch thread
+    STAGE_READY,        // in memory, waiting for the consumer
+    STAGE_TAKEN,        // handed over to the consumer
+    STAGE_SKIPPED       // dropped, failed or too big for the budget
+};
+
+static void free_staged_file(tStagedFile* file)
+{
+    if (file->name) free(file->name);
+    if (file->data) free(file->data);
+
+    file->name = NULL;
+    file->data = NULL;
+    file->size = 0;
+}
+
+static void free_staged_job(tStagedJob* job)
+{
+    free_staged_file(&job->cdg);
+    free_staged_file(&job->audio);
+}
+
+static bool read_file(FILE* f, const char* name, int size, tStagedFile* file)
+{
+    file->data = (uint8_t*)malloc(size > 0 ? size : 1);
+    if (file->data == NULL) return false;
+
+    file->size = fread(file->data, 1, size, f);
+    file->name = strdup(name);
+
+    return file->size == size;
+}
+
+static bool read_zip_entry(struct zip* archive, int idx, const char* name, int size, tStagedFile* file)
+{
+    struct zip_file* zf = zip_fopen_index(archive, idx, 0);
+    if (zf == NULL) return false;
+
+    file->data = (uint8_t*)malloc(size > 0 ? size : 1);
+    file->name = strdup(name);
+
+    while (file->data && file->size < size)
+    {
+        int read = zip_fread(zf, file->data + file->size, size - file->size);
+        if (read <= 0) break;
+        file->size += read;
+    }
+
+    zip_fclose(zf);
+    return file->data != NULL && file->size == size;
+}
+
+static int get_file_size(FILE* f)
+{
+    struct stat st;
+    if (f && fstat(fileno(f), &st) == 0) return st.st_size;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+Prefetcher::Prefetcher()
+{
+    m_jobs = NULL;
+    m_depth = 0;
+    m_budget = 0;
+    m_staged = NULL;
+    m_state = NULL;
+    m_used = 0;
+    m_next = 0;
+    m_quit = false;
+    m_running = false;
+
+    m_hits = 0;
+    m_waits = 0;
+    m_misses = 0;
+    m_staged_bytes = 0;
+    m_peak = 0;
+
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+Prefetcher::~Prefetcher()
+{
+    stop();
+
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+bool Prefetcher::start(const tLibrary* jobs, int depth, int64_t budget)
+{
+    stop();
+
+    m_jobs = jobs;
+    m_depth = depth;
+    m_budget = budget;
+    m_staged = (tStagedJob*)calloc(jobs->count + 1, sizeof(tStagedJob));
+    m_state = (int*)calloc(jobs->count + 1, sizeof(int));
+    m_used = 0;
+    m_next = 0;
+    m_quit = false;
+
+    if (pthread_create(&m_thread, NULL, threadProc, this) != 0)
+    {
+        fprintf(stderr, "WARNING: Unable to start the prefetch thread\n");
+        return false;
+    }
+
+    m_running = true;
+    return true;
+}
+
+void Prefetcher::stop()
+{
+    if (m_running)
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_quit = true;
+        pthread_cond_broadcast(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+
+        pthread_join(m_thread, NULL);
+        m_running = false;
+    }
+
+    if (m_staged)
+    {
+        for (int i = 0; i < m_jobs->count; i++)
+        {
+            if (m_state[i] == STAGE_READY) free_staged_job(&m_staged[i]);
+        }
+
+        free(m_staged);
+        free(m_state);
+        m_staged = NULL;
+        m_state = NULL;
+    }
+}
+
+bool Prefetcher::take(int idx, tStagedJob* job)
+{
+    bool hit = false;
+
+    memset(job, 0, sizeof(tStagedJob));
+    if (!m_running) return false;
+
+    pthread_mutex_lock(&m_mutex);
+
+    // drop the jobs the consumer has skipped
+    for (int i = m_next; i < idx; i++)
+    {
+        if (m_state[i] == STAGE_READY)
+        {
+            m_used -= m_staged[i].cdg.size + m_staged[i].audio.size;
+            free_staged_job(&m_staged[i]);
+        }
+        m_state[i] = STAGE_SKIPPED;
+    }
+
+    m_next = idx;
+    pthread_cond_broadcast(&m_cond);
+
+    if (m_state[idx] == STAGE_LOADING)
+    {
+        m_waits++;
+        while (m_state[idx] == STAGE_LOADING)
+        {
+            pthread_cond_wait(&m_cond, &m_mutex);
+        }
+    }
+
+    if (m_state[idx] == STAGE_READY)
+    {
+        *job = m_staged[idx];
+        memset(&m_staged[idx], 0, sizeof(tStagedJob));
+        m_state[idx] = STAGE_TAKEN;
+        m_hits++;
+        hit = true;
+    }
+    else
+    {
+        m_state[idx] = STAGE_SKIPPED;
+        m_misses++;
+    }
+
+    m_next = idx + 1;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    return hit;
+}
+
+void Prefetcher::release(tStagedJob* job)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_used -= job->cdg.size + job->audio.size;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    free_staged_job(job);
+}
+
+void Prefetcher::printStats()
+{
+    fprintf(stderr, "Prefetch: %d hits (%d waited), %d misses, %.1f MB staged, peak %.1f MB of %.1f MB\n",
+            m_hits, m_waits, m_misses,
+            m_staged_bytes / 1048576.0, m_peak / 1048576.0, m_budget / 1048576.0);
+}
+
+void* Prefetcher::threadProc(void* arg)
+{
+    ((Prefetcher*)arg)->run();
+    return NULL;
+}
+
+void Prefetcher::run()
+{
+    pthread_mutex_lock(&m_mutex);
+
+    while (!m_quit)
+    {
+        int idx = -1;
+
+        for (int i = m_next; i < m_jobs->count && i < m_next + m_depth; i++)
+        {
+            if (m_state[i] == STAGE_NONE)
+            {
+                idx = i;
+                break;
+            }
+        }
+
+        if (idx < 0)
+        {
+            pthread_cond_wait(&m_cond, &m_mutex);
+            continue;
+        }
+
+        m_state[idx] = STAGE_LOADING;
+        pthread_mutex_unlock(&m_mutex);
+
+        tStagedJob job;
+        memset(&job, 0, sizeof(tStagedJob));
+        bool ok = stageJob(idx, &job);
+
+        pthread_mutex_lock(&m_mutex);
+
+        // stageJob() reserves the budget for the data it reads
+        int64_t size = job.cdg.size + job.audio.size;
+
+        if (ok && m_state[idx] == STAGE_LOADING)
+        {
+            m_staged[idx] = job;
+            m_state[idx] = STAGE_READY;
+            m_staged_bytes += size;
+        }
+        else
+        {
+            m_used -= size;
+            free_staged_job(&job);
+            m_state[idx] = STAGE_SKIPPED;
+        }
+
+        pthread_cond_broadcast(&m_cond);
+    }
+
+    pthread_mutex_unlock(&m_mutex);
+}
+
+// Wait until 'size' bytes fit in the budget and reserve them.
+// Return false if the job doesn't fit at all or is no longer needed.
+bool Prefetcher::reserve(int idx, int64_t size)
+{
+    bool res = false;
+
+    if (size > m_budget) return false;
+
+    pthread_mutex_lock(&m_mutex);
+
+    while (m_used + size > m_budget && !m_quit && m_state[idx] == STAGE_LOADING)
+    {
+        pthread_cond_wait(&m_cond, &m_mutex);
+    }
+
+    if (!m_quit && m_state[idx] == STAGE_LOADING)
+    {
+        m_used += size;
+        if (m_used > m_peak) m_peak = m_used;
+        res = true;
+    }
+
+    pthread_mutex_unlock(&m_mutex);
+    return res;
+}
+
+// Read the inputs of a job into memory. Called without the lock held.
+bool Prefetcher::stageJob(int idx, tStagedJob* job)
+{
+    const tLibraryEntry* e = &m_jobs->entries[idx];
+    const char* ext = strrchr(e->cdgfile, '.');
+    bool ok = false;
+
+    if (ext && strcasecmp(ext + 1, "zip") == 0)
+    {
+        int error;
+        struct zip* archive = zip_open(e->cdgfile, 0, &error);
+        if (archive == NULL) return false;
+
+        // find the same entries as convert_file() does
+        struct zip_stat cdgstat, audiostat;
+        bool cdgfound = false, audiofound = false;
+        const char* name;
+
+        for (int i = 0; (name = zip_get_name(archive, i, 0)) != NULL; i++)
+        {
+            const char* p = strrchr(name, '.');
+            if (p == NULL) continue;
+
+            if (!cdgfound && strcasecmp(p + 1, "cdg") == 0)
+                cdgfound = zip_stat_index(archive, i, 0, &cdgstat) == 0;
+            else
+            if (!audiofound && is_supported_audio(p + 1))
+                audiofound = zip_stat_index(archive, i, 0, &audiostat) == 0;
+
+            if (cdgfound && audiofound) break;
+        }
+
+        if (cdgfound && reserve(idx, cdgstat.size + (audiofound ? audiostat.size : 0)))
+        {
+            ok = read_zip_entry(archive, cdgstat.index, cdgstat.name, cdgstat.size, &job->cdg);
+            if (ok && audiofound)
+                ok = read_zip_entry(archive, audiostat.index, audiostat.name, audiostat.size, &job->audio);
+
+            // account for what was actually read, run() gives it back on failure
+            int64_t reserved = cdgstat.size + (audiofound ? audiostat.size : 0);
+            pthread_mutex_lock(&m_mutex);
+            m_used += job->cdg.size + job->audio.size - reserved;
+            pthread_mutex_unlock(&m_mutex);
+        }
+
+        zip_close(archive);
+    }
+    else
+    {
+        // the audio of x.cdg.zst is x.mp3, as in convert_file
+        char* cdgname = strdup(e->cdgfile);
+        if (is_zstd_cdg(cdgname)) cdgname[strlen(cdgname) - 4] = 0;
+
+        char* audiofile = e->audiofile ? strdup(e->audiofile) : get_audio_filename(cdgname);
+        free(cdgname);
+
+        FILE* fcdg = fopen(e->cdgfile, "r");
+        FILE* faudio = audiofile ? fopen(audiofile, "r") : NULL;
+        int cdgsize = get_file_size(fcdg);
+        int audiosize = get_file_size(faudio);
+
+        if (fcdg && reserve(idx, cdgsize + audiosize))
+        {
+            ok = read_file(fcdg, e->cdgfile, cdgsize, &job->cdg);
+            if (ok && faudio)
+                ok = read_file(faudio, audiofile, audiosize, &job->audio);
+
+            pthread_mutex_lock(&m_mutex);
+            m_used += job->cdg.size + job->audio.size - (cdgsize + audiosize);
+            pthread_mutex_unlock(&m_mutex);
+        }
+
+        if (fcdg) fclose(fcdg);
+        if (faudio) fclose(faudio);
+        if (audiofile) free(audiofile);
+    }
+
+    return ok;
+}
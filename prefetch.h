@@ -0,0 +1,90 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __INC_PREFETCH_H__
+#define __INC_PREFETCH_H__
+
+#include <pthread.h>
+#include <inttypes.h>
+#include "scanner.h"
+
+// A file read into memory. For zip archives the entry is inflated.
+typedef struct {
+    char*    name;
+    uint8_t* data;
+    int      size;
+} tStagedFile;
+
+// The inputs of one batch job
+typedef struct {
+    tStagedFile cdg;
+    tStagedFile audio;  // data is NULL if there is no audio file
+} tStagedJob;
+
+// Reads the inputs of the next jobs of a batch into memory in a background
+// thread, while the current job is encoding. At most 'depth' jobs ahead are
+// staged and the staged data never exceeds 'budget' bytes.
+class Prefetcher
+{
+public:
+    Prefetcher();
+    ~Prefetcher();
+
+    bool start(const tLibrary* jobs, int depth, int64_t budget);
+    void stop();
+
+    // Get the staged inputs of job 'idx', waiting for it if it's being staged
+    // right now. Jobs before 'idx' are dropped. Return false on a miss, then
+    // the caller shall open the files itself.
+    bool take(int idx, tStagedJob* job);
+
+    // Free the inputs returned by take()
+    void release(tStagedJob* job);
+
+    void printStats();
+
+protected:
+    static void* threadProc(void* arg);
+    void run();
+    bool reserve(int idx, int64_t size);
+    bool stageJob(int idx, tStagedJob* job);
+
+protected:
+    const tLibrary* m_jobs;
+    int      m_depth;
+    int64_t  m_budget;
+
+    tStagedJob* m_staged;   // one slot per job
+    int*     m_state;       // one of the STAGE_* values per job
+    int64_t  m_used;        // bytes held by staged and taken jobs
+    int      m_next;        // next job the consumer will take
+    bool     m_quit;
+
+    pthread_t       m_thread;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t  m_cond;
+    bool     m_running;
+
+    // statistics
+    int      m_hits;
+    int      m_waits;       // hits the consumer had to wait for
+    int      m_misses;
+    int64_t  m_staged_bytes;
+    int64_t  m_peak;
+};
+
+#endif // __INC_PREFETCH_H__
@@ -0,0 +1,294 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // vmsplice, F_GETPIPE_SZ
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "rawsink.h"
+
+static const char y4m_frame_header[] = "FRAME\n";
+
+// Open 'filename' for writing, "-" is the standard output
+static int open_output(const char* filename, bool* close_it)
+{
+    *close_it = strcmp(filename, "-") != 0;
+
+    int fd = *close_it ? ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    if (fd < 0)
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+
+    return fd;
+}
+
+static bool write_fd(int fd, const void* buf, int size)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+
+    while (size > 0)
+    {
+        ssize_t res = ::write(fd, p, size);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+
+        p += res;
+        size -= res;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+Y4mWriter::Y4mWriter()
+{
+    m_fd = -1;
+    m_close = false;
+    m_splice = false;
+    m_buffers = NULL;
+    m_count = 0;
+    m_current = 0;
+    m_frameSize = 0;
+    m_bufferSize = 0;
+}
+
+Y4mWriter::~Y4mWriter()
+{
+    close();
+}
+
+bool Y4mWriter::open(const char* filename, int width, int height, int fps_num, int fps_den,
+                     int sar_num, int sar_den, const char* chroma, int chroma_w, int chroma_h)
+{
+    close();
+
+    m_fd = open_output(filename, &m_close);
+    if (m_fd < 0) return false;
+
+    m_width = width;
+    m_height = height;
+    m_chromaWidth = (width + chroma_w - 1) / chroma_w;
+    m_chromaHeight = (height + chroma_h - 1) / chroma_h;
+    m_frameSize = width * height + 2 * m_chromaWidth * m_chromaHeight;
+
+    int page = sysconf(_SC_PAGESIZE);
+    m_bufferSize = (m_frameSize + page - 1) / page * page;
+
+    // the pipe holds references to the pages spliced in it, a buffer may be
+    // written again once more pages than it can hold were spliced after it
+    struct stat st;
+    m_splice = fstat(m_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    m_count = 2;
+
+#ifdef F_GETPIPE_SZ
+    if (m_splice)
+    {
+        int pipe_size = fcntl(m_fd, F_GETPIPE_SZ);
+        if (pipe_size > 0)
+            m_count = pipe_size / page / (m_bufferSize / page) + 2;
+    }
+#endif
+
+    if (posix_memalign((void**)&m_buffers, page, (size_t)m_count * m_bufferSize) != 0)
+    {
+        fprintf(stderr, "Memory error\n");
+        m_buffers = NULL;
+        close();
+        return false;
+    }
+
+    char header[128];
+    int len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A%d:%d C%s\n",
+                       width, height, fps_num, fps_den, sar_num ? sar_num : 1, sar_num ? sar_den : 1, chroma);
+
+    if (!write_fd(m_fd, header, len))
+    {
+        fprintf(stderr, "Could not write the Y4M header\n");
+        close();
+        return false;
+    }
+
+    m_current = 0;
+    return true;
+}
+
+void Y4mWriter::close()
+{
+    if (m_fd >= 0 && m_close)
+        ::close(m_fd);
+
+    m_fd = -1;
+
+    free(m_buffers);
+    m_buffers = NULL;
+}
+
+void Y4mWriter::beginFrame(uint8_t* data[4], int linesize[4])
+{
+    uint8_t* frame = m_buffers + (size_t)m_current * m_bufferSize;
+
+    data[0] = frame;
+    data[1] = data[0] + m_width * m_height;
+    data[2] = data[1] + m_chromaWidth * m_chromaHeight;
+    data[3] = NULL;
+
+    linesize[0] = m_width;
+    linesize[1] = linesize[2] = m_chromaWidth;
+    linesize[3] = 0;
+}
+
+bool Y4mWriter::writeFrame()
+{
+    struct iovec iov[2];
+
+    iov[0].iov_base = (void*)y4m_frame_header;
+    iov[0].iov_len = sizeof(y4m_frame_header) - 1;
+    iov[1].iov_base = m_buffers + (size_t)m_current * m_bufferSize;
+    iov[1].iov_len = m_frameSize;
+
+    m_current = (m_current + 1) % m_count;
+
+    int first = 0;
+    while (first < 2)
+    {
+        ssize_t res = m_splice ? vmsplice(m_fd, &iov[first], 2 - first, 0) :
+                                 writev(m_fd, &iov[first], 2 - first);
+
+        if (res < 0 && errno == EINTR) continue;
+
+        if (res < 0 && m_splice && first == 0 && iov[0].iov_len == sizeof(y4m_frame_header) - 1)
+        {
+            // not a pipe vmsplice can write in, fall back to writev
+            m_splice = false;
+            continue;
+        }
+
+        if (res <= 0) return false;
+
+        // skip what was written
+        while (first < 2 && res >= (ssize_t)iov[first].iov_len)
+            res -= iov[first++].iov_len;
+
+        if (first < 2)
+        {
+            iov[first].iov_base = (uint8_t*)iov[first].iov_base + res;
+            iov[first].iov_len -= res;
+        }
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+WavWriter::WavWriter()
+{
+    m_fd = -1;
+    m_close = false;
+    m_dataSize = 0;
+}
+
+WavWriter::~WavWriter()
+{
+    close();
+}
+
+static void put_le32(uint8_t* p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void put_le16(uint8_t* p, uint16_t v)
+{
+    p[0] = v; p[1] = v >> 8;
+}
+
+bool WavWriter::writeHeader(uint32_t data_size)
+{
+    uint8_t header[44];
+
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, data_size == 0xFFFFFFFF ? data_size : data_size + 36);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le32(header + 16, 16);
+    put_le16(header + 20, 1);                           // PCM
+    put_le16(header + 22, m_channels);
+    put_le32(header + 24, m_sampleRate);
+    put_le32(header + 28, m_sampleRate * m_channels * 2);
+    put_le16(header + 32, m_channels * 2);
+    put_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put_le32(header + 40, data_size);
+
+    return write_fd(m_fd, header, sizeof(header));
+}
+
+bool WavWriter::open(const char* filename, int sample_rate, int channels)
+{
+    close();
+
+    m_fd = open_output(filename, &m_close);
+    if (m_fd < 0) return false;
+
+    m_sampleRate = sample_rate;
+    m_channels = channels;
+    m_dataSize = 0;
+
+    // the real length is written at the end, if the output can seek
+    if (!writeHeader(0xFFFFFFFF))
+    {
+        fprintf(stderr, "Could not write the WAV header\n");
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void WavWriter::close()
+{
+    if (m_fd < 0) return;
+
+    if (m_dataSize <= 0xFFFFFFFF - 36 && lseek(m_fd, 0, SEEK_SET) == 0)
+        writeHeader((uint32_t)m_dataSize);
+
+    if (m_close)
+        ::close(m_fd);
+
+    m_fd = -1;
+}
+
+bool WavWriter::write(const int16_t* samples, int count)
+{
+    int size = count * m_channels * 2;
+    m_dataSize += size;
+
+    return write_fd(m_fd, samples, size);
+}
@@ -0,0 +1,91 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __INC_RAWSINK_H__
+#define __INC_RAWSINK_H__
+
+#include <inttypes.h>
+
+// Uncompressed outputs for external encoders, without libavformat: the
+// video frames in the YUV4MPEG2 format and the audio in a WAV stream. "-"
+// is the standard output. A pipe or a file both work, for a pipe the
+// headers carry no length.
+
+// YUV4MPEG2 writer. The frames are kept in a ring of page aligned buffers
+// the caller scales into, each plane without padding. On a pipe the
+// buffers are handed to the kernel with vmsplice, without a copy: a buffer
+// is reused only once the pipe can't hold its pages any more.
+class Y4mWriter
+{
+public:
+    Y4mWriter();
+    ~Y4mWriter();
+
+    // 'chroma' is the Y4M colour space (420jpeg, 422, 444), the chroma
+    // planes are subsampled by 'chroma_w' x 'chroma_h'
+    bool open(const char* filename, int width, int height, int fps_num, int fps_den,
+              int sar_num, int sar_den, const char* chroma, int chroma_w, int chroma_h);
+    void close();
+
+    bool isOpen() { return m_fd >= 0; }
+
+    // Buffer of the next frame, to be filled before writeFrame()
+    void beginFrame(uint8_t* data[4], int linesize[4]);
+    bool writeFrame();
+
+protected:
+    int      m_fd;
+    bool     m_close;       // not the standard output
+    bool     m_splice;      // the output is a pipe
+    uint8_t* m_buffers;
+    int      m_count;       // frames in the ring
+    int      m_current;
+    int      m_frameSize;   // bytes of one frame, the planes in a row...
+    int      m_bufferSize;  // ...rounded up to whole pages
+    int      m_width;
+    int      m_height;
+    int      m_chromaWidth;
+    int      m_chromaHeight;
+};
+
+// WAV writer, 16 bit interleaved samples. The lengths are set at the end
+// when the output can seek, a pipe gets the largest ones instead.
+class WavWriter
+{
+public:
+    WavWriter();
+    ~WavWriter();
+
+    bool open(const char* filename, int sample_rate, int channels);
+    void close();
+
+    bool isOpen() { return m_fd >= 0; }
+
+    bool write(const int16_t* samples, int count);
+
+protected:
+    bool writeHeader(uint32_t data_size);
+
+protected:
+    int      m_fd;
+    bool     m_close;
+    int      m_sampleRate;
+    int      m_channels;
+    int64_t  m_dataSize;
+};
+
+#endif // __INC_RAWSINK_H__
@@ -0,0 +1,451 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_CONSTANT_MACROS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "ffmpeg_headers.h"
+#include "scanner.h"
+#include "utils.h"
+
+// A directory entry of interest, collected during the readdir pass
+typedef struct {
+    char* name;
+    int   stemlen;  // length of the name without the extension
+    int   kind;
+    int   prio;     // audio preference, lower is better
+} tDirItem;
+
+static int compare_items(const void* a, const void* b)
+{
+    const tDirItem* ia = (const tDirItem*)a;
+    const tDirItem* ib = (const tDirItem*)b;
+
+    int len = ia->stemlen < ib->stemlen ? ia->stemlen : ib->stemlen;
+    int res = strncasecmp(ia->name, ib->name, len);
+
+    if (res == 0) res = ia->stemlen - ib->stemlen;
+    if (res == 0) res = ia->kind - ib->kind;
+    if (res == 0) res = ia->prio - ib->prio;
+    if (res == 0) res = strcmp(ia->name, ib->name);
+
+    return res;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    return strcmp(((const tLibraryEntry*)a)->cdgfile, ((const tLibraryEntry*)b)->cdgfile);
+}
+
+static char* join_path(const char* dir, const char* name)
+{
+    size_t len = strlen(dir);
+    char* path = (char*)malloc(len + strlen(name) + 2);
+
+    strcpy(path, dir);
+    if (len > 0 && dir[len - 1] != '/') strcat(path, "/");
+    strcat(path, name);
+
+    return path;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void library_init(tLibrary* lib)
+{
+    lib->entries = NULL;
+    lib->count = 0;
+    lib->allocated = 0;
+}
+
+void library_free(tLibrary* lib)
+{
+    for (int i = 0; i < lib->count; i++)
+    {
+        free(lib->entries[i].cdgfile);
+        if (lib->entries[i].audiofile) free(lib->entries[i].audiofile);
+    }
+
+    free(lib->entries);
+    library_init(lib);
+}
+
+tLibraryEntry* library_add(tLibrary* lib, const char* cdgfile, const char* audiofile)
+{
+    if (lib->count == lib->allocated)
+    {
+        lib->allocated = lib->allocated ? lib->allocated * 2 : 256;
+        lib->entries = (tLibraryEntry*)realloc(lib->entries, lib->allocated * sizeof(tLibraryEntry));
+    }
+
+    tLibraryEntry* e = &lib->entries[lib->count++];
+    memset(e, 0, sizeof(tLibraryEntry));
+
+    e->cdgfile = strdup(cdgfile);
+    e->audiofile = audiofile ? strdup(audiofile) : NULL;
+
+    return e;
+}
+
+tLibraryEntry* library_add_entry(tLibrary* lib, const tLibraryEntry* entry)
+{
+    tLibraryEntry copy = *entry;
+    tLibraryEntry* e = library_add(lib, entry->cdgfile, entry->audiofile);
+
+    copy.cdgfile = e->cdgfile;
+    copy.audiofile = e->audiofile;
+    *e = copy;
+
+    return e;
+}
+
+int library_classify(const char* name, int* stemlen, int* prio)
+{
+    const char* ext = strrchr(name, '.');
+    int kind = -1;
+
+    *prio = 0;
+    if (ext == NULL) return -1;
+
+    if (strcasecmp(ext + 1, "cdg") == 0) kind = LIBRARY_ITEM_CDG;
+    else
+    if (is_zstd_cdg(name)) 
+    {
+        kind = LIBRARY_ITEM_ZST;
+        ext -= 4;   // the name is compared without .cdg.zst
+    }
+    else
+    if (strcasecmp(ext + 1, "zip") == 0) kind = LIBRARY_ITEM_ZIP;
+    else
+    if (is_supported_audio(ext + 1))
+    {
+        kind = LIBRARY_ITEM_AUDIO;
+        *prio = get_audio_priority(ext + 1);
+    }
+
+    *stemlen = ext - name;
+    return kind;
+}
+
+// Scan a single directory, pairing the files of the same name.
+// Subdirectories are scanned after the directory itself is closed,
+// so only one directory handle is open at a time.
+static int scan_directory(tLibrary* lib, const char* dir)
+{
+    DIR* d = opendir(dir);
+    if (d == NULL)
+    {
+        fprintf(stderr, "Unable to open directory: %s\n", dir);
+        return -1;
+    }
+
+    tDirItem* items = NULL;
+    int count = 0, allocated = 0;
+    struct dirent* de;
+
+    while ((de = readdir(d)) != NULL)
+    {
+        const char* name = de->d_name;
+        if (name[0] == '.') continue;   // skip ".", ".." and hidden files
+
+        int kind = -1;
+        int prio = 0;
+        int type = de->d_type;
+
+        if (type == DT_UNKNOWN || type == DT_LNK)
+        {
+            // the file system doesn't report the type or this is a symlink,
+            // fall back to stat. Symlinked directories are not followed.
+            struct stat st;
+            if (fstatat(dirfd(d), name, &st, 0) != 0) continue;
+
+            if (S_ISDIR(st.st_mode)) type = (de->d_type == DT_LNK) ? DT_LNK : DT_DIR;
+            else if (S_ISREG(st.st_mode)) type = DT_REG;
+        }
+
+        int stemlen = 0;
+
+        if (type == DT_DIR)
+        {
+            kind = LIBRARY_ITEM_DIR;
+            stemlen = strlen(name);
+        }
+        else
+        if (type == DT_REG)
+        {
+            kind = library_classify(name, &stemlen, &prio);
+        }
+
+        if (kind < 0) continue;
+
+        if (count == allocated)
+        {
+            allocated = allocated ? allocated * 2 : 64;
+            items = (tDirItem*)realloc(items, allocated * sizeof(tDirItem));
+        }
+
+        items[count].name = strdup(name);
+        items[count].stemlen = stemlen;
+        items[count].kind = kind;
+        items[count].prio = prio;
+        count++;
+    }
+
+    // Items with the same name (case-insensitive) end up next to each other,
+    // CDG files first and the preferred audio file right after them.
+    qsort(items, count, sizeof(tDirItem), compare_items);
+
+    for (int first = 0, last; first < count; first = last)
+    {
+        const tDirItem* audio = NULL;
+        bool hascdg = false;
+
+        for (last = first; last < count; last++)
+        {
+            if (items[last].stemlen != items[first].stemlen ||
+                strncasecmp(items[last].name, items[first].name, items[first].stemlen) != 0)
+                break;
+
+            if (audio == NULL && items[last].kind == LIBRARY_ITEM_AUDIO)
+                audio = &items[last];
+
+            if (items[last].kind == LIBRARY_ITEM_CDG)
+                hascdg = true;
+        }
+
+        for (int i = first; i < last; i++)
+        {
+            if (items[i].kind != LIBRARY_ITEM_CDG && items[i].kind != LIBRARY_ITEM_ZST && items[i].kind != LIBRARY_ITEM_ZIP) continue;
+
+            // a packed copy of a CDG file is not converted twice
+            if (items[i].kind == LIBRARY_ITEM_ZST && hascdg) continue;
+
+            struct stat st;
+            if (fstatat(dirfd(d), items[i].name, &st, 0) != 0) continue;
+
+            char* cdgfile = join_path(dir, items[i].name);
+            char* audiofile = NULL;
+            tLibraryEntry* e;
+
+            if (items[i].kind != LIBRARY_ITEM_ZIP && audio)
+            {
+                audiofile = join_path(dir, audio->name);
+            }
+
+            e = library_add(lib, cdgfile, audiofile);
+            e->cdg_size = st.st_size;
+            e->cdg_mtime = st.st_mtime;
+
+            if (audiofile && fstatat(dirfd(d), audio->name, &st, 0) == 0)
+            {
+                e->audio_size = st.st_size;
+                e->audio_mtime = st.st_mtime;
+            }
+
+            free(cdgfile);
+            if (audiofile) free(audiofile);
+        }
+    }
+
+    closedir(d);
+
+    // Now descend into the subdirectories
+    for (int i = 0; i < count; i++)
+    {
+        if (items[i].kind == LIBRARY_ITEM_DIR)
+        {
+            char* subdir = join_path(dir, items[i].name);
+            scan_directory(lib, subdir);
+            free(subdir);
+        }
+
+        free(items[i].name);
+    }
+
+    free(items);
+    return 0;
+}
+
+int library_scan(tLibrary* lib, const char* dir)
+{
+    int first = lib->count;
+    int res = scan_directory(lib, dir);
+
+    fprintf(stderr, "Scanned %s: %d CDG files found\n", dir, lib->count - first);
+    return res;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+int library_load_manifest(tLibrary* lib, const char* file)
+{
+    FILE* f = fopen(file, "r");
+    if (f == NULL) return -1;
+
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &size, f)) > 0)
+    {
+        if (line[0] == '#') continue;
+        if (line[len - 1] == '\n') line[--len] = 0;
+
+        long long cdg_size, cdg_mtime, audio_size, audio_mtime;
+        int pos = 0;
+
+        if (sscanf(line, "%lld\t%lld\t%lld\t%lld\t%n",
+                   &cdg_size, &cdg_mtime, &audio_size, &audio_mtime, &pos) != 4 || pos == 0)
+            continue;
+
+        char* cdgfile = line + pos;
+        char* audiofile = strchr(cdgfile, '\t');
+        if (audiofile) *audiofile++ = 0;
+        if (audiofile && *audiofile == 0) audiofile = NULL;
+
+        tLibraryEntry* e = library_add(lib, cdgfile, audiofile);
+        e->cdg_size = cdg_size;
+        e->cdg_mtime = cdg_mtime;
+        e->audio_size = audio_size;
+        e->audio_mtime = audio_mtime;
+    }
+
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+int library_load_list(tLibrary* lib, const char* file)
+{
+    FILE* f = fopen(file, "r");
+    if (f == NULL) return -1;
+
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &size, f)) > 0)
+    {
+        if (line[len - 1] == '\n') line[--len] = 0;
+        if (len > 0 && line[len - 1] == '\r') line[--len] = 0;
+        if (len == 0 || line[0] == '#') continue;
+
+        char* audiofile = strchr(line, '\t');
+        if (audiofile) *audiofile++ = 0;
+        if (audiofile && *audiofile == 0) audiofile = NULL;
+
+        tLibraryEntry* e = library_add(lib, line, audiofile);
+
+        struct stat st;
+        if (stat(line, &st) == 0)
+        {
+            e->cdg_size = st.st_size;
+            e->cdg_mtime = st.st_mtime;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+int library_save_manifest(const tLibrary* lib, const char* file)
+{
+    // write to a temporary file first, so an interrupted run
+    // doesn't leave a truncated manifest behind
+    char* tmpfile = (char*)malloc(strlen(file) + 8);
+    sprintf(tmpfile, "%s.tmp", file);
+
+    FILE* f = fopen(tmpfile, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Unable to write manifest: %s\n", file);
+        free(tmpfile);
+        return -1;
+    }
+
+    fprintf(f, "# %s %s manifest\n", PACKAGE, VERSION);
+
+    for (int i = 0; i < lib->count; i++)
+    {
+        const tLibraryEntry* e = &lib->entries[i];
+
+        fprintf(f, "%lld\t%lld\t%lld\t%lld\t%s\t%s\n",
+                (long long)e->cdg_size, (long long)e->cdg_mtime,
+                (long long)e->audio_size, (long long)e->audio_mtime,
+                e->cdgfile, e->audiofile ? e->audiofile : "");
+    }
+
+    int res = fclose(f);
+    if (res == 0) res = rename(tmpfile, file);
+    if (res != 0) fprintf(stderr, "Unable to write manifest: %s\n", file);
+
+    free(tmpfile);
+    return res;
+}
+
+void library_mark_unchanged(tLibrary* lib, const tLibrary* prev)
+{
+    if (prev->count == 0) return;
+
+    tLibraryEntry* sorted = (tLibraryEntry*)malloc(prev->count * sizeof(tLibraryEntry));
+    memcpy(sorted, prev->entries, prev->count * sizeof(tLibraryEntry));
+    qsort(sorted, prev->count, sizeof(tLibraryEntry), compare_entries);
+
+    for (int i = 0; i < lib->count; i++)
+    {
+        tLibraryEntry* e = &lib->entries[i];
+        const tLibraryEntry* p = (const tLibraryEntry*)bsearch(e, sorted, prev->count,
+                                                  sizeof(tLibraryEntry), compare_entries);
+        if (p == NULL) continue;
+
+        e->unchanged = p->cdg_size == e->cdg_size && p->cdg_mtime == e->cdg_mtime &&
+                       p->audio_size == e->audio_size && p->audio_mtime == e->audio_mtime &&
+                       ((p->audiofile == NULL && e->audiofile == NULL) ||
+                        (p->audiofile && e->audiofile && strcmp(p->audiofile, e->audiofile) == 0));
+    }
+
+    free(sorted);
+}
+
+void library_merge(tLibrary* lib, const tLibrary* prev, const tLibrary* exclude)
+{
+    tLibraryEntry* sorted = (tLibraryEntry*)malloc((exclude->count + 1) * sizeof(tLibraryEntry));
+    memcpy(sorted, exclude->entries, exclude->count * sizeof(tLibraryEntry));
+    qsort(sorted, exclude->count, sizeof(tLibraryEntry), compare_entries);
+
+    for (int i = 0; i < prev->count; i++)
+    {
+        const tLibraryEntry* e = &prev->entries[i];
+
+        if (bsearch(e, sorted, exclude->count, sizeof(tLibraryEntry), compare_entries) == NULL)
+            library_add_entry(lib, e);
+    }
+
+    free(sorted);
+}
@@ -0,0 +1,86 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CDG2VIDEO_SCANNER_H
+#define _CDG2VIDEO_SCANNER_H
+
+#include <sys/types.h>
+#include <time.h>
+
+// One CDG file found in the library, together with its audio file.
+// Zip archives are listed with audiofile == NULL, the pair is inside.
+typedef struct {
+    char*  cdgfile;
+    off_t  cdg_size;
+    time_t cdg_mtime;
+
+    char*  audiofile;
+    off_t  audio_size;
+    time_t audio_mtime;
+
+    int    unchanged;   // same as in the previous manifest
+} tLibraryEntry;
+
+// Kinds of the files of interest in the library
+enum
+{
+    LIBRARY_ITEM_CDG = 0,
+    LIBRARY_ITEM_ZST,       // seekable zstd compressed CDG file
+    LIBRARY_ITEM_ZIP,
+    LIBRARY_ITEM_AUDIO,
+    LIBRARY_ITEM_DIR
+};
+
+typedef struct {
+    tLibraryEntry* entries;
+    int count;
+    int allocated;
+} tLibrary;
+
+void library_init(tLibrary* lib);
+void library_free(tLibrary* lib);
+tLibraryEntry* library_add(tLibrary* lib, const char* cdgfile, const char* audiofile);
+tLibraryEntry* library_add_entry(tLibrary* lib, const tLibraryEntry* entry);
+
+// Get the kind of a file by its name, -1 if it's not of interest.
+// 'stemlen' is the length of the name without the extension(s),
+// 'prio' is the preference of an audio file (lower is better).
+int  library_classify(const char* name, int* stemlen, int* prio);
+
+// Walk 'dir' recursively (one readdir pass per directory) and add every
+// CDG file, paired case-insensitively with its audio file.
+int  library_scan(tLibrary* lib, const char* dir);
+
+// The manifest is a text file with one line per entry:
+//  cdg_size <TAB> cdg_mtime <TAB> audio_size <TAB> audio_mtime <TAB> cdgfile <TAB> audiofile
+int  library_load_manifest(tLibrary* lib, const char* file);
+int  library_save_manifest(const tLibrary* lib, const char* file);
+
+// The song list is a text file with one song per line, in playing order:
+//  cdgfile [<TAB> audiofile]
+// Empty lines and lines starting with # are skipped.
+int  library_load_list(tLibrary* lib, const char* file);
+
+// Set 'unchanged' for entries found with the same sizes and times in 'prev'
+void library_mark_unchanged(tLibrary* lib, const tLibrary* prev);
+
+// Add the entries of 'prev' that are not in 'exclude' to 'lib', so the
+// manifest keeps the files that were not part of this run
+void library_merge(tLibrary* lib, const tLibrary* prev, const tLibrary* exclude);
+
+#endif // #define _CDG2VIDEO_SCANNER_H
+
@@ -0,0 +1,151 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shmring.h"
+
+#define SHM_RING_ALIGN(x)   (((x) + 63) & ~63)
+
+ShmRing::ShmRing()
+{
+    m_name = NULL;
+    m_header = NULL;
+    m_size = 0;
+}
+
+ShmRing::~ShmRing()
+{
+    close();
+}
+
+bool ShmRing::create(const char* name, int width, int height, int tile_columns, int tile_rows, int slots)
+{
+    close();
+
+    m_name = (char*)malloc(strlen(name) + 2);
+    sprintf(m_name, "%s%s", name[0] == '/' ? "" : "/", name);
+
+    // the lines and the slots start on a cache line
+    uint32_t stride = SHM_RING_ALIGN(width * 4);
+    uint32_t damage_offset = SHM_RING_ALIGN(sizeof(tShmRingSlot));
+    uint32_t pixel_offset = SHM_RING_ALIGN(damage_offset + tile_columns * tile_rows);
+    uint32_t slot_size = SHM_RING_ALIGN(pixel_offset + stride * height);
+
+    m_size = SHM_RING_ALIGN(sizeof(tShmRingHeader)) + (size_t)slots * slot_size;
+
+    int fd = shm_open(m_name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to create the shared memory %s: %s\n", m_name, strerror(errno));
+        free(m_name);
+        m_name = NULL;
+        return false;
+    }
+
+    void* mem = MAP_FAILED;
+
+    // a ring left by a previous run is cleared by the truncation
+    if (ftruncate(fd, 0) == 0 && ftruncate(fd, m_size) == 0)
+        mem = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map the shared memory %s: %s\n", m_name, strerror(errno));
+        shm_unlink(m_name);
+        free(m_name);
+        m_name = NULL;
+        return false;
+    }
+
+    m_header = (tShmRingHeader*)mem;
+    m_header->version = SHM_RING_VERSION;
+    m_header->slots = slots;
+    m_header->slot_size = slot_size;
+    m_header->width = width;
+    m_header->height = height;
+    m_header->stride = stride;
+    m_header->tile_columns = tile_columns;
+    m_header->tile_rows = tile_rows;
+    m_header->damage_offset = damage_offset;
+    m_header->pixel_offset = pixel_offset;
+    m_header->sequence = 0;
+
+    __atomic_store_n(&m_header->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void ShmRing::close()
+{
+    if (m_header)
+    {
+        munmap(m_header, m_size);
+        m_header = NULL;
+    }
+
+    if (m_name)
+    {
+        shm_unlink(m_name);
+        free(m_name);
+        m_name = NULL;
+    }
+}
+
+tShmRingSlot* ShmRing::getSlot(uint64_t n)
+{
+    return (tShmRingSlot*)((uint8_t*)m_header + SHM_RING_ALIGN(sizeof(tShmRingHeader)) +
+                           (n % m_header->slots) * m_header->slot_size);
+}
+
+uint32_t* ShmRing::beginFrame(uint8_t** damage)
+{
+    uint64_t n = m_header->sequence;
+    tShmRingSlot* slot = getSlot(n);
+
+    // the readers of the previous frame in this slot see it's gone before
+    // any of its data changes
+    __atomic_store_n(&slot->sequence, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    *damage = (uint8_t*)slot + m_header->damage_offset;
+    return (uint32_t*)((uint8_t*)slot + m_header->pixel_offset);
+}
+
+void ShmRing::publishFrame(int64_t pts, int changed_tiles)
+{
+    uint64_t n = m_header->sequence;
+    tShmRingSlot* slot = getSlot(n);
+
+    slot->pts = pts;
+    slot->changed_tiles = changed_tiles;
+
+    __atomic_store_n(&slot->sequence, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&m_header->sequence, n + 1, __ATOMIC_RELEASE);
+}
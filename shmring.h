@@ -0,0 +1,98 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __INC_SHMRING_H__
+#define __INC_SHMRING_H__
+
+#include <inttypes.h>
+
+// Ring of rendered frames in POSIX shared memory, for local readers (a
+// compositor, a preview window...). Any number of readers map the ring
+// read-only and use the frames in place, the writer never waits for them.
+//
+// Layout: a tShmRingHeader, then 'slots' slots of 'slot_size' bytes. Each
+// slot starts with a tShmRingSlot, followed by the damage map at
+// 'damage_offset' (one byte per tile, rows first, non-zero if the tile
+// changed since the previous frame) and the pixels at 'pixel_offset'
+// (32 bit 0x00RRGGBB, 'stride' bytes per line).
+//
+// Sequence protocol, frame n (from 0) is written in slot n % slots:
+//  - the writer sets the slot sequence to 2n+1 while it writes the frame,
+//    to 2n+2 when it's complete, then the header sequence to n+1;
+//  - a reader loads the header sequence s (acquire), the frame s-1 is the
+//    latest one. It loads the slot sequence (acquire), which shall be 2s,
+//    uses the frame, then loads the slot sequence again: if it changed,
+//    the writer came round and the frame shall be dropped.
+
+#define SHM_RING_MAGIC      0x52474443      // "CDGR"
+#define SHM_RING_VERSION    1
+#define SHM_RING_SLOTS      8
+
+typedef struct {
+    uint32_t magic;             // set last, once the header is complete
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;         // bytes from one slot to the next
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            // bytes per line of pixels
+    uint32_t tile_columns;
+    uint32_t tile_rows;
+    uint32_t damage_offset;     // from the start of the slot
+    uint32_t pixel_offset;
+    uint32_t reserved;
+    uint64_t sequence;          // frames published so far
+} tShmRingHeader;
+
+typedef struct {
+    uint64_t sequence;          // odd while the frame is written
+    int64_t  pts;               // in miliseconds
+    uint32_t changed_tiles;
+    uint32_t reserved;
+} tShmRingSlot;
+
+class ShmRing
+{
+public:
+    ShmRing();
+    ~ShmRing();
+
+    // Create the shared memory object 'name' (a leading / is added if
+    // missing) holding 'slots' frames of width x height pixels
+    bool create(const char* name, int width, int height, int tile_columns, int tile_rows, int slots);
+
+    // Unmap and unlink the ring, the readers keep their mapping
+    void close();
+
+    bool isOpen() { return m_header != NULL; }
+    int  getStride() { return m_header->stride; }
+
+    // Start writing the next frame: return its pixels and damage map, to
+    // be filled before publishFrame()
+    uint32_t* beginFrame(uint8_t** damage);
+    void publishFrame(int64_t pts, int changed_tiles);
+
+protected:
+    tShmRingSlot* getSlot(uint64_t n);
+
+protected:
+    char*    m_name;
+    tShmRingHeader* m_header;
+    size_t   m_size;
+};
+
+#endif // __INC_SHMRING_H__
@@ -0,0 +1,308 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_CONSTANT_MACROS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ffmpeg_headers.h"
+#include "thumbnail.h"
+
+#define MAX_SCENE_RESETS    1024
+#define MIN_PAGE_MS         2000    // shorter pages are intro flashes or wipes
+
+static int compare_times(const void *a, const void *b)
+{
+    long ta = *(const long*)a;
+    long tb = *(const long*)b;
+    return (ta > tb) - (ta < tb);
+}
+
+int thumbnails_parse(const char* arg, long* times, int max)
+{
+    int count = 0;
+
+    if (strcmp(arg, "auto") == 0) return 0;
+
+    while (*arg)
+    {
+        char* end;
+        double sec = strtod(arg, &end);
+
+        if (end == arg || sec < 0 || (*end != ',' && *end != 0) || count == max) return -1;
+
+        times[count++] = (long)(sec * 1000);
+        arg = *end ? end + 1 : end;
+    }
+
+    qsort(times, count, sizeof(long), compare_times);
+    return count;
+}
+
+// Pick up to 'count' pages of the song, each one just before the screen is
+// cleared for the next page. Without scene resets (or when the stream can't
+// be scanned) the times are spread over the song.
+static int pick_auto(CDGFile* cdg, long* times, int count)
+{
+    long* resets = (long*)malloc((MAX_SCENE_RESETS + 1) * sizeof(long));
+    int n = cdg->findSceneResets(resets, MAX_SCENE_RESETS);
+    long duration = cdg->getTotalDuration();
+    long start = 0;
+    int pages = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (resets[i] - start >= MIN_PAGE_MS) resets[pages++] = resets[i];
+        start = resets[i];
+    }
+
+    // the end of the song closes the last page, only when real pages were
+    // found, the song is spread evenly otherwise
+    if (pages > 0 && duration - start >= MIN_PAGE_MS) resets[pages++] = duration;
+
+    if (pages > count)
+    {
+        // evenly over the pages, from the middle of each share
+        for (int i = 0; i < count; i++) times[i] = resets[(2 * i + 1) * pages / (2 * count)];
+    }
+    else
+    if (pages > 0)
+    {
+        memcpy(times, resets, pages * sizeof(long));
+        count = pages;
+    }
+    else
+    if (duration > 0)
+    {
+        for (int i = 0; i < count; i++) times[i] = (i + 1) * duration / (count + 1);
+    }
+    else
+    {
+        count = 0;
+    }
+
+    free(resets);
+    return count;
+}
+
+static AVFrame* alloc_image(PixelFormat pix_fmt, int width, int height)
+{
+    AVFrame* image = av_frame_alloc();
+    if (!image) return NULL;
+
+    if (av_image_alloc(image->data, image->linesize, width, height, pix_fmt, 16) < 0)
+    {
+        av_frame_free(&image);
+        return NULL;
+    }
+
+    image->width = width;
+    image->height = height;
+    image->format = pix_fmt;
+
+    return image;
+}
+
+static void free_image(AVFrame** image)
+{
+    if (*image == NULL) return;
+
+    av_freep(&(*image)->data[0]);
+    av_frame_free(image);
+}
+
+// Copy the rendered screen to the RGB24 image, at the given tile
+static void copy_screen(const ISurface* surface, AVFrame* image, int left, int top)
+{
+    for (int y = 0; y < CDG_FULL_HEIGHT; y++)
+    {
+        uint8_t* p = image->data[0] + (top + y) * image->linesize[0] + left * 3;
+
+        for (int x = 0; x < CDG_FULL_WIDTH; x++, p += 3)
+        {
+            p[0] = (uint8_t)(surface->rgbData[y][x] >> 16);
+            p[1] = (uint8_t)(surface->rgbData[y][x] >> 8);
+            p[2] = (uint8_t)(surface->rgbData[y][x]);
+        }
+    }
+}
+
+// Encode the RGB24 image in the pixel format the encoder prefers, RGB24
+// itself if it takes it, and write it to 'filename'
+static bool write_image(AVCodec* codec, AVFrame* rgb, const char* filename)
+{
+    PixelFormat pix_fmt = PIX_FMT_RGB24;
+    AVFrame* image = rgb;
+    AVCodecContext* c = NULL;
+    AVPacket pkt;
+    int got_packet = 0;
+    bool res = false;
+
+    if (codec->pix_fmts)
+    {
+        pix_fmt = (PixelFormat)codec->pix_fmts[0];
+        for (int i = 0; codec->pix_fmts[i] != -1; i++)
+        {
+            if ((int)codec->pix_fmts[i] == (int)PIX_FMT_RGB24) pix_fmt = PIX_FMT_RGB24;
+        }
+    }
+
+    if (pix_fmt != PIX_FMT_RGB24)
+    {
+        struct SwsContext* sws = sws_getContext(rgb->width, rgb->height, PIX_FMT_RGB24,
+                                                rgb->width, rgb->height, pix_fmt,
+                                                SWS_POINT, NULL, NULL, NULL);
+
+        image = sws ? alloc_image(pix_fmt, rgb->width, rgb->height) : NULL;
+        if (image)
+        {
+            sws_scale(sws, rgb->data, rgb->linesize, 0, rgb->height, image->data, image->linesize);
+        }
+        sws_freeContext(sws);
+
+        if (image == NULL)
+        {
+            fprintf(stderr, "Unable to convert the thumbnail to %s\n", av_get_pix_fmt_name(pix_fmt));
+            return false;
+        }
+    }
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    c = avcodec_alloc_context3(codec);
+    if (c)
+    {
+        c->width = image->width;
+        c->height = image->height;
+        c->pix_fmt = pix_fmt;
+        c->time_base = av_make_q(1, 25);
+    }
+
+    if (c == NULL || avcodec_open2(c, codec, NULL) < 0)
+    {
+        fprintf(stderr, "Could not open the %s encoder\n", codec->name);
+    }
+    else
+    if (avcodec_encode_video2(c, &pkt, image, &got_packet) < 0 || !got_packet)
+    {
+        fprintf(stderr, "Error while encoding the thumbnail %s\n", filename);
+    }
+    else
+    {
+        FILE* f = fopen(filename, "wb");
+
+        if (f && fwrite(pkt.data, 1, pkt.size, f) == (size_t)pkt.size && fclose(f) == 0)
+        {
+            res = true;
+        }
+        else
+        {
+            fprintf(stderr, "Unable to write the thumbnail %s\n", filename);
+            if (f) fclose(f);
+        }
+    }
+
+    av_free_packet(&pkt);
+    avcodec_free_context(&c);
+    if (image != rgb) free_image(&image);
+
+    return res;
+}
+
+int thumbnails_extract(CDGFile* cdg, const ISurface* surface, const char* basename,
+                       const tThumbnailOptions* opts)
+{
+    long times[THUMBNAIL_MAX];
+    int count = thumbnails_parse(opts->times, times, THUMBNAIL_MAX);
+    int64_t started = av_gettime();
+
+    if (count == 0) count = pick_auto(cdg, times, opts->count);
+
+    if (count <= 0)
+    {
+        fprintf(stderr, "No thumbnails to extract (the song length is unknown)\n");
+        return -1;
+    }
+
+    AVCodec* codec = avcodec_find_encoder(strcmp(opts->format, "webp") == 0 ? AV_CODEC_ID_WEBP : AV_CODEC_ID_PNG);
+    if (!codec)
+    {
+        fprintf(stderr, "No %s encoder in this FFmpeg build\n", opts->format);
+        return -1;
+    }
+
+    int columns = opts->sheet_columns;
+    int rows = columns ? (count + columns - 1) / columns : 1;
+    AVFrame* image = columns ? alloc_image(PIX_FMT_RGB24, columns * CDG_FULL_WIDTH, rows * CDG_FULL_HEIGHT)
+                             : alloc_image(PIX_FMT_RGB24, CDG_FULL_WIDTH, CDG_FULL_HEIGHT);
+    if (!image)
+    {
+        fprintf(stderr, "Could not allocate the thumbnail picture\n");
+        return -1;
+    }
+
+    // the unused tiles of the sheet stay black
+    if (columns) memset(image->data[0], 0, image->linesize[0] * image->height);
+
+    char* filename = (char*)malloc(strlen(basename) + 32);
+    int written = 0;
+    int res = 0;
+
+    for (int i = 0; i < count && res == 0; i++)
+    {
+        // the packets up to the time are processed, only this frame is rendered
+        if (!cdg->renderAtPosition(times[i]))
+        {
+            fprintf(stderr, "WARNING: The song ends before %.2f s\n", times[i] / 1000.0);
+            break;
+        }
+
+        if (columns)
+        {
+            copy_screen(surface, image, (i % columns) * CDG_FULL_WIDTH, (i / columns) * CDG_FULL_HEIGHT);
+            written++;
+            continue;
+        }
+
+        copy_screen(surface, image, 0, 0);
+        sprintf(filename, "%s-%02d.%s", basename, i + 1, opts->format);
+
+        if (write_image(codec, image, filename)) written++;
+        else res = -1;
+    }
+
+    if (columns && written > 0 && res == 0)
+    {
+        sprintf(filename, "%s-sheet.%s", basename, opts->format);
+        if (!write_image(codec, image, filename)) res = -1;
+    }
+
+    fprintf(stderr, "Thumbnails: %d in %.1f ms\n", written, (av_gettime() - started) / 1000.0);
+
+    free(filename);
+    free_image(&image);
+
+    return written > 0 ? res : -1;
+}
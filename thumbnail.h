@@ -0,0 +1,43 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CDG2VIDEO_THUMBNAIL_H
+#define _CDG2VIDEO_THUMBNAIL_H
+
+#include "cdgfile.h"
+
+#define THUMBNAIL_MAX   64
+
+typedef struct {
+    const char* times;      // comma separated times in seconds, or "auto"
+    int count;              // number of thumbnails picked in the auto mode
+    int sheet_columns;      // tiled in one contact sheet, 0 - one image per thumbnail
+    const char* format;     // "png" or "webp"
+} tThumbnailOptions;
+
+// Parse the times of the --thumbnails option in miliseconds, sorted.
+// Returns the number of times, 0 for "auto" or -1 if the list is invalid.
+int thumbnails_parse(const char* arg, long* times, int max);
+
+// Render the thumbnails of the open CDG file and write them as
+// <basename>-NN.<format>, or as one <basename>-sheet.<format>. The CDG
+// is only advanced between the picked times, nothing else is rendered.
+// Returns 0 on success.
+int thumbnails_extract(CDGFile* cdg, const ISurface* surface, const char* basename,
+                       const tThumbnailOptions* opts);
+
+#endif // #define _CDG2VIDEO_THUMBNAIL_H
@@ -94,6 +94,24 @@ bool is_supported_audio(const char* ext)
     return false;
 }
 
+// Check for the seekable zstd compressed CDG files (*.cdg.zst)
+bool is_zstd_cdg(const char* filename)
+{
+    size_t len = strlen(filename);
+    return len > 8 && strcasecmp(filename + len - 8, ".cdg.zst") == 0;
+}
+
+// Preference of the audio file extension, lower is better (mp3, ogg, flac)
+int get_audio_priority(const char* ext)
+{
+    for (int i = 0; audio_files[i] != NULL; i++) 
+    {
+        if (strcasecmp(ext, audio_files[i]) == 0) return i / 3;
+    }
+
+    return -1;
+}
+
 int get_frame_rate(int *frame_rate_num, int *frame_rate_den, const char *arg)
 {
     int i = 0;
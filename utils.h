@@ -30,6 +30,8 @@ typedef struct {
 
 char* get_audio_filename(const char* cdgfile);
 bool  is_supported_audio(const char* ext);
+int   get_audio_priority(const char* ext);
+bool  is_zstd_cdg(const char* filename);
 int   get_frame_rate(int *frame_rate_num, int *frame_rate_den, const char *arg);
 int   get_frame_size(int *width_ptr, int *height_ptr, const char *str);
 int   get_aspect_ratio(AVRational *aspect_ratio, const char *arg);
@@ -0,0 +1,442 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_CONSTANT_MACROS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "ffmpeg_headers.h"
+#include "scanner.h"
+#include "jobpool.h"
+#include "watch.h"
+
+#define WATCH_EVENTS    (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO)
+#define SETTLE_TIME     5           // seconds without a change, for a file that got no close event
+#define PAIR_EXPIRY     3600        // seconds a half waits for the other one
+
+enum
+{
+    HALF_NONE = 0,      // not seen yet
+    HALF_WRITING,       // created, not closed yet
+    HALF_COMPLETE       // closed after writing, moved in or there before we started
+};
+
+typedef struct {
+    int   wd;
+    char* path;
+} tWatchDir;
+
+// CDG and audio file of the same name, waiting for the other half
+typedef struct {
+    int   dir;          // index in the watched directories
+    char* stem;
+    char* cdgfile;
+    int   cdg;          // HALF_* state
+    char* audiofile;
+    int   audio;
+    int64_t updated;    // time of the last event
+} tPair;
+
+typedef struct {
+    char*   cdgfile;
+    char*   audiofile;
+    int64_t queued;
+} tQueuedJob;
+
+typedef struct {
+    tConvertFunc convert;
+    const char*  cdgfile;
+    const char*  audiofile;
+} tJobArgs;
+
+static volatile sig_atomic_t watch_quit = 0;
+
+static tWatchDir* dirs = NULL;
+static int dir_count = 0;
+
+static tPair* pairs = NULL;
+static int pair_count = 0;
+
+static tQueuedJob* queue = NULL;
+static int queue_count = 0;
+
+static void watch_signal(int sig)
+{
+    watch_quit = 1;
+}
+
+static int run_job(void* arg)
+{
+    tJobArgs* args = (tJobArgs*)arg;
+    return args->convert(args->cdgfile, args->audiofile);
+}
+
+static char* join_path(const char* dir, const char* name, int len)
+{
+    char* path = (char*)malloc(strlen(dir) + len + 2);
+    sprintf(path, "%s/%.*s", dir, len, name);
+    return path;
+}
+
+static void add_watch(int fd, const char* path, bool recursive)
+{
+    int wd = inotify_add_watch(fd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0)
+    {
+        fprintf(stderr, "Unable to watch directory %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    dirs = (tWatchDir*)realloc(dirs, (dir_count + 1) * sizeof(tWatchDir));
+    dirs[dir_count].wd = wd;
+    dirs[dir_count].path = strdup(path);
+    dir_count++;
+
+    fprintf(stderr, "Watching: %s\n", path);
+
+    if (!recursive) return;
+
+    DIR* d = opendir(path);
+    struct dirent* de;
+
+    while (d && (de = readdir(d)) != NULL)
+    {
+        if (de->d_name[0] == '.' || de->d_type != DT_DIR) continue;
+
+        char* subdir = join_path(path, de->d_name, strlen(de->d_name));
+        add_watch(fd, subdir, true);
+        free(subdir);
+    }
+
+    if (d) closedir(d);
+}
+
+static int find_dir(int wd)
+{
+    for (int i = 0; i < dir_count; i++)
+    {
+        if (dirs[i].wd == wd) return i;
+    }
+
+    return -1;
+}
+
+static tPair* find_pair(int dir, const char* name, int stemlen)
+{
+    for (int i = 0; i < pair_count; i++)
+    {
+        if (pairs[i].dir == dir && (int)strlen(pairs[i].stem) == stemlen &&
+            strncasecmp(pairs[i].stem, name, stemlen) == 0)
+            return &pairs[i];
+    }
+
+    pairs = (tPair*)realloc(pairs, (pair_count + 1) * sizeof(tPair));
+
+    tPair* pair = &pairs[pair_count++];
+    memset(pair, 0, sizeof(tPair));
+    pair->dir = dir;
+    pair->stem = strndup(name, stemlen);
+    pair->updated = jobpool_time();
+
+    return pair;
+}
+
+static void remove_pair(tPair* pair)
+{
+    free(pair->stem);
+    if (pair->cdgfile) free(pair->cdgfile);
+    if (pair->audiofile) free(pair->audiofile);
+
+    *pair = pairs[--pair_count];
+}
+
+// Look in the directory for the other half of a pair, which was there
+// before we started watching
+static char* find_existing(const char* dir, const char* stem, bool audio)
+{
+    DIR* d = opendir(dir);
+    struct dirent* de;
+    char* found = NULL;
+    int best = -1;
+
+    while (d && (de = readdir(d)) != NULL)
+    {
+        int stemlen, prio;
+        int kind = library_classify(de->d_name, &stemlen, &prio);
+
+        if (kind < 0 || (kind == LIBRARY_ITEM_AUDIO) != audio || kind == LIBRARY_ITEM_ZIP) continue;
+        if ((int)strlen(stem) != stemlen || strncasecmp(stem, de->d_name, stemlen) != 0) continue;
+
+        if (found == NULL || prio < best)
+        {
+            if (found) free(found);
+            found = join_path(dir, de->d_name, strlen(de->d_name));
+            best = prio;
+        }
+    }
+
+    if (d) closedir(d);
+    return found;
+}
+
+static void queue_job(const char* cdgfile, const char* audiofile)
+{
+    queue = (tQueuedJob*)realloc(queue, (queue_count + 1) * sizeof(tQueuedJob));
+    queue[queue_count].cdgfile = strdup(cdgfile);
+    queue[queue_count].audiofile = audiofile ? strdup(audiofile) : NULL;
+    queue[queue_count].queued = jobpool_time();
+    queue_count++;
+
+    fprintf(stderr, "Queued: %s\n", cdgfile);
+}
+
+// Queue the pair once both halves are written, the other half may be
+// older than the watch. Returns true if the pair was queued and removed.
+static bool complete_pair(tPair* pair)
+{
+    const char* dir = dirs[pair->dir].path;
+
+    if (pair->cdg == HALF_NONE && (pair->cdgfile = find_existing(dir, pair->stem, false)))
+        pair->cdg = HALF_COMPLETE;
+
+    if (pair->audio == HALF_NONE && (pair->audiofile = find_existing(dir, pair->stem, true)))
+        pair->audio = HALF_COMPLETE;
+
+    if (pair->cdg != HALF_COMPLETE || pair->audio != HALF_COMPLETE) return false;
+
+    queue_job(pair->cdgfile, pair->audiofile);
+    remove_pair(pair);
+    return true;
+}
+
+static void file_event(int dir, const char* name, uint32_t mask)
+{
+    int stemlen, prio;
+    int kind = library_classify(name, &stemlen, &prio);
+
+    if (kind < 0) return;
+
+    int state = (mask & IN_CREATE) ? HALF_WRITING : HALF_COMPLETE;
+
+    if (kind == LIBRARY_ITEM_ZIP)
+    {
+        // the archive holds both halves
+        if (state == HALF_COMPLETE)
+        {
+            char* zipfile = join_path(dirs[dir].path, name, strlen(name));
+            queue_job(zipfile, NULL);
+            free(zipfile);
+        }
+        return;
+    }
+
+    tPair* pair = find_pair(dir, name, stemlen);
+    char** file = (kind == LIBRARY_ITEM_AUDIO) ? &pair->audiofile : &pair->cdgfile;
+    int* half = (kind == LIBRARY_ITEM_AUDIO) ? &pair->audio : &pair->cdg;
+
+    if (*file) free(*file);
+    *file = join_path(dirs[dir].path, name, strlen(name));
+    *half = state;
+    pair->updated = jobpool_time();
+
+    if (state != HALF_COMPLETE) return;
+
+    complete_pair(pair);
+}
+
+// Files found in a directory created or moved in after the watch started,
+// they were there before its watch was added
+static void scan_dir(int dir)
+{
+    DIR* d = opendir(dirs[dir].path);
+    struct dirent* de;
+
+    while (d && (de = readdir(d)) != NULL)
+    {
+        if (de->d_name[0] == '.' || de->d_type == DT_DIR) continue;
+        file_event(dir, de->d_name, IN_MOVED_TO);
+    }
+
+    if (d) closedir(d);
+}
+
+// A half that got IN_CREATE only (a hard link, or a writer that keeps the
+// file open) counts as written once its time stops changing
+static bool settle_half(const char* file, int* half)
+{
+    struct stat st;
+
+    if (*half != HALF_WRITING || file == NULL || stat(file, &st) != 0) return false;
+    if (time(NULL) - st.st_mtime < SETTLE_TIME) return false;
+
+    *half = HALF_COMPLETE;
+    return true;
+}
+
+// Settle the quiet halves and drop the pairs waiting too long for the
+// other half
+static void check_pairs()
+{
+    int64_t now = jobpool_time();
+
+    for (int i = 0; i < pair_count; i++)
+    {
+        tPair* pair = &pairs[i];
+        int64_t idle = (now - pair->updated) / 1000000;
+
+        if (idle < SETTLE_TIME) continue;
+
+        bool settled = settle_half(pair->cdgfile, &pair->cdg);
+        settled = settle_half(pair->audiofile, &pair->audio) || settled;
+
+        if (settled && complete_pair(pair))
+        {
+            i--;    // the last pair took its place
+        }
+        else
+        if (idle >= PAIR_EXPIRY)
+        {
+            fprintf(stderr, "Dropped (no %s file after %d s): %s\n",
+                    pair->cdg == HALF_NONE ? "CDG" : "audio", PAIR_EXPIRY,
+                    pair->cdgfile ? pair->cdgfile : pair->audiofile);
+            remove_pair(pair);
+            i--;
+        }
+    }
+}
+
+static void read_events(int fd, bool recursive)
+{
+    char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(fd, buf, sizeof(buf));
+
+    for (char* p = buf; len > 0 && p < buf + len; )
+    {
+        struct inotify_event* ev = (struct inotify_event*)p;
+        p += sizeof(struct inotify_event) + ev->len;
+
+        int dir = find_dir(ev->wd);
+        if (dir < 0 || ev->len == 0) continue;
+
+        if (ev->mask & IN_ISDIR)
+        {
+            if (recursive && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+            {
+                char* subdir = join_path(dirs[dir].path, ev->name, strlen(ev->name));
+                int first = dir_count;
+
+                add_watch(fd, subdir, true);
+                free(subdir);
+
+                // the files moved in with the directory (or written before
+                // its watch was added) get no events
+                for (int i = first; i < dir_count; i++) scan_dir(i);
+            }
+            continue;
+        }
+
+        file_event(dir, ev->name, ev->mask);
+    }
+}
+
+int watch_folders(char* const* paths, int count, bool recursive, int jobs, tConvertFunc convert)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to initialize inotify: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        add_watch(fd, paths[i], recursive);
+    }
+
+    if (dir_count == 0)
+    {
+        close(fd);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    JobPool pool;
+    pool.setMaxJobs(jobs);
+
+    while (!watch_quit)
+    {
+        // start the queued jobs, the oldest first
+        while (queue_count > 0 && !pool.isFull())
+        {
+            tJobArgs args = { convert, queue[0].cdgfile, queue[0].audiofile };
+            int64_t wait = jobpool_time() - queue[0].queued;
+
+            if (pool.start(queue[0].cdgfile, run_job, &args) > 0)
+                fprintf(stderr, "Started: %s (queued %.1f s)\n", queue[0].cdgfile, wait / 1000000.0);
+
+            free(queue[0].cdgfile);
+            if (queue[0].audiofile) free(queue[0].audiofile);
+            memmove(&queue[0], &queue[1], (--queue_count) * sizeof(tQueuedJob));
+        }
+
+        // wake up regularly while jobs are running, to start the next ones,
+        // and while halves are waiting, to settle or expire them
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int res = poll(&pfd, 1, pool.getRunning() ? 200 : pair_count ? 1000 : -1);
+
+        if (res > 0 && (pfd.revents & POLLIN))
+        {
+            read_events(fd, recursive);
+        }
+
+        check_pairs();
+
+        tJob job;
+        while (pool.reap(&job, false))
+        {
+            fprintf(stderr, "%s: %s (%.1f s)\n", job.status == 0 ? "Done" : "Failed", job.name,
+                    (jobpool_time() - job.started) / 1000000.0);
+            free(job.name);
+        }
+    }
+
+    fprintf(stderr, "Waiting for %d running jobs\n", pool.getRunning());
+    pool.waitAll();
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+/*
+    Copyright (C) 2009 by Nikolay Nikolov <nknikolov@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CDG2VIDEO_WATCH_H
+#define _CDG2VIDEO_WATCH_H
+
+typedef int (*tConvertFunc)(const char* cdgfile, const char* audiofile);
+
+// Watch the directories with inotify and convert every new CDG+audio pair
+// (or zip file) as soon as both files are completely written. Up to 'jobs'
+// conversions run at the same time. Runs until SIGINT or SIGTERM.
+int watch_folders(char* const* dirs, int count, bool recursive, int jobs, tConvertFunc convert);
+
+#endif // #define _CDG2VIDEO_WATCH_H